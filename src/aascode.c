@@ -21,10 +21,8 @@ static uint32_t fitness(const char *cv) {
 }
 
 static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
-    int ct = 0;
     code c = (code)parent;
-    int l = c->len;
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     code child = (code)ch;
     for (int k = 2; k < P; k++) {
         if (c->mask[k] != 1) {
@@ -112,9 +110,13 @@ int main(int argc, char **argv) {
     ((code)seed)->mask[1] = 1;
     ((code)seed)->mask[P-1] = 2;
     ((code)seed)->mask[2] = 2;
-    int nresults;
-    char * results = beam_search(seed,1,visit_children, beamsize, len-2,
-                                 data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
+    size_t nresults;
+    // a code that covers every residue ends the search, so look for one among the best first
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.fittest_first = true;
+    char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, len-2,
+                                      data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
     int maxfitness = 0;
     const char * bestcode = NULL;
     int *fitcounts = calloc(sizeof(int),P+1);
@@ -23,7 +23,7 @@ static uint32_t fitness(const char *cv) {
 static void visit_children(const char *parent, void (*visit)(const char *, void *), void *context) {
     chain c = (chain)parent;
     int l = c->len;
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     chain child = (chain)ch;
     for (int i =1; i < l; i++)
         for (int j = 1; j <= i; j++) {
@@ -69,6 +69,18 @@ static uint64_t hash( const char *c) {
     return h;    
 }
 
+// each element added to a chain of length l reaches at most itself and its
+// differences either way with the l before it
+static uint32_t bound(const char *cv, int gens) {
+    chain c = (chain)cv;
+    if (c->fitness == stop_fitness)
+        return stop_fitness;
+    uint64_t b = c->fitness;
+    for (int l = c->len; l < c->len + gens && b < P; l++)
+        b += 1 + 2*l;
+    return b >= P ? stop_fitness : b;
+}
+
 static void print_chain(const char *i) {
     const chain c = (chain) i;
     printf("<chain");
@@ -97,9 +109,14 @@ int main(int argc, char **argv) {
     ((chain)seed)->mask[0] = 1;
     ((chain)seed)->mask[1] = 1;
     ((chain)seed)->mask[P-1] = 2;
-    int nresults;
-    char * results = beam_search(seed,1,visit_children, beamsize, len-2,
-                                 data_size,  fitness, equal, hash, nprobes, print_chain, &nresults);
+    size_t nresults;
+    // a finished chain ends the search, so look for one among the best first
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.fittest_first = true;
+    opts.bound = bound;
+    char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, len-2,
+                                      data_size,  fitness, equal, hash, nprobes, print_chain, &nresults);
     int maxfitness = 0;
     const char * bestchain = NULL;
     int *fitcounts = calloc(sizeof(int),P+1);
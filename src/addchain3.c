@@ -26,7 +26,7 @@ static uint32_t fitness(const char *cv) {
 static void visit_children(const char *parent, void (*visit)(const char *, void *), void *context) {
     chain c = (chain)parent;
     int l = c->len;
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     chain child = (chain)ch;
     for (int i =1; i < l; i++)
         for (int j = 1; j <= i; j++) {
@@ -114,10 +114,14 @@ int main(int argc, char **argv) {
                     int x = (b*(a + code[i])) % P;
                     targets[x] = true;
                 }
-                int nresults;
-                char * results = beam_search(seed,1,visit_children, beamsize, len-2,
-                                             data_size,  fitness, equal, hash, nprobes,
-                                             print_chain, &nresults);
+                size_t nresults;
+                // a finished chain ends the search, so look for one among the best first
+                beam_options opts;
+                beam_default_options(&opts);
+                opts.fittest_first = true;
+                char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, len-2,
+                                                  data_size,  fitness, equal, hash, nprobes,
+                                                  print_chain, &nresults);
                 int maxfitness = 0;
                 const char * bestchain = NULL;
                 int *fitcounts = calloc(sizeof(int),P+1);
@@ -21,10 +21,8 @@ static uint32_t fitness(const char *cv) {
 }
 
 static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
-    int ct = 0;
     code c = (code)parent;
-    int l = c->len;
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     code child = (code)ch;
     for (int k = 2; k < P; k++) {
         if (c->mask[k] != (char)1) {
@@ -68,6 +66,18 @@ static uint64_t hash( const char *c) {
     return h;    
 }
 
+// each element added to a code of length l reaches at most itself and its
+// differences either way with the l before it
+static uint32_t bound(const char *cv, int gens) {
+    code c = (code)cv;
+    if (c->fitness == stop_fitness)
+        return stop_fitness;
+    uint64_t b = c->fitness;
+    for (int l = c->len; l < c->len + gens && b < P; l++)
+        b += 1 + 2*l;
+    return b >= P ? stop_fitness : b;
+}
+
 static void print_code(const char *i) {
     const code c = (code) i;
     printf("<code");
@@ -97,9 +107,14 @@ int main(int argc, char **argv) {
     ((code)seed)->mask[0] = 1;
     ((code)seed)->mask[1] = 1;
     ((code)seed)->mask[P-1] = 2;
-    int nresults;
-    char * results = beam_search(seed,1,visit_children, beamsize, len-2,
-                                 data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
+    size_t nresults;
+    // a code that covers every residue ends the search, so look for one among the best first
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.fittest_first = true;
+    opts.bound = bound;
+    char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, len-2,
+                                      data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
     int maxfitness = 0;
     const char * bestcode = NULL;
     int *fitcounts = calloc(sizeof(int),P+1);
@@ -1,49 +1,213 @@
 #include "beam.h"
 #include <omp.h>
 #include <stdio.h>
+#include <time.h>
+#ifdef BENCH
+#include <sys/resource.h>
+#endif
 
 #define cpu_relax() asm volatile("pause\n" : : : "memory")
 
+// spread a driver's hash over all 64 bits before taking a few of them to pick
+// a place with: drivers' hashes can be weak in the low bits (fmix64)
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCD;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53;
+  return x ^ (x >> 33);
+}
+
+// Closed set: 16 bit fingerprints of the (mixed) hashes of items already
+// expanded, four to a 64 bit bucket, each hash with a choice of two buckets in
+// the same cache line. When both
+// are full a slot is overwritten, so the set forgets rather than grows; a
+// false positive (another item's fingerprint) wrongly drops a new item.
+typedef struct {
+  uint64_t *buckets;
+  uint64_t mask;
+  uint64_t (*key)(const char *, uint64_t); // from an item and its hash, or NULL for the hash
+  uint64_t added, dropped;
+  uint64_t forgotten; // fingerprints overwritten
+} closedset;
+
+static closedset *new_closed(size_t bytes, uint64_t (*key)(const char *, uint64_t)) {
+  uint64_t nbuckets = 8;
+  while (nbuckets * 2 * sizeof(uint64_t) <= bytes)
+    nbuckets *= 2;
+  closedset *c = calloc(1, sizeof(closedset));
+  c->buckets = aligned_alloc(64, nbuckets * sizeof(uint64_t));
+  memset(c->buckets, 0, nbuckets * sizeof(uint64_t));
+  c->mask = nbuckets - 1;
+  c->key = key;
+  return c;
+}
+
+static void free_closed(closedset *c) {
+  free(c->buckets);
+  free(c);
+}
+
+static inline uint64_t fingerprint(uint64_t h) {
+  uint64_t fp = h >> 48;
+  return fp ? fp : 1;
+}
+
+static inline bool bucket_has(uint64_t b, uint64_t fp) {
+  for (int s = 0; s < 4; s++)
+    if (((b >> (16 * s)) & 0xFFFF) == fp)
+      return true;
+  return false;
+}
+
+static inline uint64_t other_bucket(uint64_t i, uint64_t h) {
+  return i ^ (((h >> 24) & 7) | 1);
+}
+
+static bool closed_contains(const closedset *c, uint64_t h) {
+  h = mix64(h);
+  uint64_t fp = fingerprint(h), i = h & c->mask;
+  return bucket_has(c->buckets[i], fp) ||
+         bucket_has(c->buckets[other_bucket(i, h)], fp);
+}
+
+// false if h's fingerprint was already there
+static bool closed_add(closedset *c, uint64_t h) {
+  h = mix64(h);
+  uint64_t fp = fingerprint(h), i = h & c->mask;
+  uint64_t *b[2] = {c->buckets + i, c->buckets + other_bucket(i, h)};
+  while (1) {
+    uint64_t old[2] = {*b[0], *b[1]};
+    if (bucket_has(old[0], fp) || bucket_has(old[1], fp))
+      return false;
+    uint64_t *at = NULL, new = 0;
+    for (int k = 0; k < 2 && !at; k++)
+      for (int s = 0; s < 4; s++)
+        if (((old[k] >> (16 * s)) & 0xFFFF) == 0) {
+          at = b[k];
+          new = old[k] | (fp << (16 * s));
+          break;
+        }
+    int k = 0;
+    bool forget = !at;
+    if (forget) {
+      // both full: forget one, chosen by the new fingerprint
+      k = fp & 1;
+      int s = (fp >> 1) & 3;
+      at = b[k];
+      new = (old[k] & ~((uint64_t)0xFFFF << (16 * s))) | (fp << (16 * s));
+    } else
+      k = at == b[1];
+    if (__sync_bool_compare_and_swap(at, old[k], new)) {
+      if (forget)
+        __sync_fetch_and_add(&c->forgotten, 1);
+      return true;
+    }
+  }
+}
+
+// In deterministic mode each item has a bucket of nprobes slots, which holds
+// the best distinct items offered to it in a total order, sorted, whatever
+// order they come in; anything that depends on timing waits for the end of
+// the generation.
+static bool deterministic;
+
 typedef struct s_hashtab {
     fitness_t *fitness; 
+    uint64_t *hashes; // hash of each stored item, to skip most comparisons
+    uint64_t *ids; // identity_hash of each stored item, in hash only identity mode
     char *data;
     size_t data_size;
     size_t tabsize;
     fitness_t (*fitness_func)(const char *);
     bool (*equal)(const char *, const char *);
     uint64_t (*hash)(const char *);
+    uint64_t (*identity_hash)(const char *);
+    bool verify; // check hash only identities with equal, counting collisions
     uint64_t nprobes;
     void (*print_item)(const char *);
+    bool (*dominates)(const char *, const char *);
+    closedset *closed;
+    fitness_t (*bound)(const char *, int);
+    int gens_left; // generations still to come after this one
+    uint64_t salt; // moves every item's slots, so islands keep different items
+    void (*sink)(const char *, int, bool);
+    fitness_t sink_threshold;
+    closedset *sunk; // what the sink has had this generation, shared by the islands
+    int gen; // of the items in the table, the seeds being 0
+    char *locks; // one per bucket, in deterministic mode
 } * hashtab;
 
+// the false positive rate is that of a lookup against the final fill
+static void print_closed(const closedset *c) {
+  uint64_t used = 0;
+  for (uint64_t i = 0; i <= c->mask; i++)
+    for (int s = 0; s < 4; s++)
+      used += ((c->buckets[i] >> (16 * s)) & 0xFFFF) != 0;
+  double fill = (double)used / (4 * (c->mask + 1));
+  printf("Closed set: %lu expanded, %lu children dropped, %.1f%% full, "
+         "%lu forgotten, false positive rate about %.2g\n",
+         c->added, c->dropped, 100 * fill, c->forgotten, 8 * fill / 65535);
+}
+
 static hashtab new_ht(size_t data_size, size_t tabsize,
                       fitness_t (*fitness_func)(const char *),
                       bool (*equal)(const char *, const char *),
-                      uint64_t (*hash)(const char *), uint64_t nprobes,
-                      void (*print_item)(const char *)) {
+                      uint64_t (*hash)(const char *),
+                      uint64_t (*identity_hash)(const char *), uint64_t nprobes,
+                      void (*print_item)(const char *),
+                      bool (*dominates)(const char *, const char *)) {
   hashtab h = (hashtab)malloc(sizeof(struct s_hashtab));
   if (tabsize < 17)
     tabsize = 17;
+  // whole buckets of nprobes slots in deterministic mode, at least one
+  if (deterministic)
+    tabsize = tabsize < nprobes ? nprobes : tabsize - tabsize % nprobes;
   h->fitness = (fitness_t *)calloc(4, tabsize);
+  h->hashes = (uint64_t *)malloc(sizeof(uint64_t) * tabsize);
+  h->ids = identity_hash ? (uint64_t *)malloc(sizeof(uint64_t) * tabsize) : NULL;
   h->data = calloc(data_size, tabsize);
   h->data_size = data_size;
   h->tabsize = tabsize;
   h->fitness_func = fitness_func;
   h->equal = equal;
   h->hash = hash;
+  h->identity_hash = identity_hash;
+  h->verify = false;
   h->nprobes = nprobes;
   h->print_item = print_item;
+  h->dominates = dominates;
+  h->closed = NULL;
+  h->bound = NULL;
+  h->gens_left = 0;
+  h->salt = 0;
+  h->sink = NULL;
+  h->sink_threshold = 0;
+  h->sunk = NULL;
+  h->gen = 0;
+  h->locks = deterministic ? calloc(tabsize / nprobes, 1) : NULL;
   return h;
 }
 
 static void free_ht(hashtab h) {
   free(h->fitness);
+  free(h->hashes);
+  free(h->ids);
   free(h->data);
+  free(h->locks);
   free(h);
 }
 
 #define IN_USE 0xFFFFFFFF
 
+#ifdef BENCH
+// times this thread retried a CAS or waited for a slot or bucket another held
+static __thread uint64_t spins;
+#define count_spin() (spins++)
+#else
+#define count_spin()
+#endif
+
 fitness_t get_control(hashtab h, uint64_t k, fitness_t fit) {
   while (1) {
     fitness_t nfit = __sync_val_compare_and_swap(&(h->fitness[k]), fit, IN_USE);
@@ -51,20 +215,188 @@ fitness_t get_control(hashtab h, uint64_t k, fitness_t fit) {
       //            printf("Locked %li %i %i\n",k, omp_get_thread_num(), fit);
       return fit;
     }
+    count_spin();
     if (nfit != IN_USE)
       fit = nfit;
     cpu_relax();
   }
 }
 
-static bool earlystop;
+// set by whichever thread first inserts an item of stop_fitness; from then on
+// only such items are inserted and threads skip the parents they have left
+static volatile bool earlystop;
+
+static inline bool cancelled_for(const hashtab h, const char *item) {
+  return earlystop && !deterministic && h->fitness_func(item) != stop_fitness;
+}
+
+// the best fitness of any child so far, for bound
+static volatile fitness_t best_seen;
+
+static void raise_best(fitness_t f) {
+  fitness_t b = best_seen;
+  while (f > b) {
+    fitness_t old = __sync_val_compare_and_swap(&best_seen, b, f);
+    if (old == b)
+      return;
+    b = old;
+  }
+}
+
+// hash only identities matched, and how many of those equal rejected
+static uint64_t id_matches, id_collisions;
+
+static inline uint64_t identity_of(const hashtab h, const char *item) {
+  return h->identity_hash ? h->identity_hash(item) : 0;
+}
+
+// whether item, with identity id, is the one in slot key, whose hash it has.
+// In hash only identity mode the slot's data is only read to verify.
+static inline bool same_item(const hashtab h, const char *item, uint64_t key,
+                             uint64_t id) {
+  if (!h->identity_hash)
+    return h->equal(item, h->data + h->data_size * key);
+  if (h->ids[key] != id)
+    return false;
+  if (h->verify) {
+    __sync_fetch_and_add(&id_matches, 1);
+    if (!h->equal(item, h->data + h->data_size * key))
+      __sync_fetch_and_add(&id_collisions, 1);
+  }
+  return true;
+}
+
+// an item has just gone into h: pass it on if it is good enough, and the sink
+// has not had it this generation (going by its hash and identity, as a
+// fingerprint in a set like the closed one)
+static inline void sink_new(const hashtab h, const char *item, fitness_t fit,
+                            uint64_t hash, uint64_t id) {
+  if (h->sink && fit >= h->sink_threshold &&
+      closed_add(h->sunk, hash ^ id * 0x9E3779B97F4A7C15ULL))
+    h->sink(item, h->gen, false);
+}
+
+// the total order of deterministic mode: fitness, then hash, then bytes (all
+// of them, so objects must have no bytes left unwritten, see beam.h)
+static inline bool better(const hashtab h, fitness_t fa, uint64_t ha,
+                          const char *a, fitness_t fb, uint64_t hb,
+                          const char *b) {
+  if (fa != fb)
+    return fa > fb;
+  if (ha != hb)
+    return ha < hb;
+  return memcmp(a, b, h->data_size) < 0;
+}
+
+static inline uint64_t bucket_of(const hashtab h, uint64_t hash) {
+  return mix64(hash ^ h->salt) % (h->tabsize / h->nprobes);
+}
+
+static inline void move_slot(hashtab h, uint64_t to, uint64_t from) {
+  h->fitness[to] = h->fitness[from];
+  h->hashes[to] = h->hashes[from];
+  if (h->ids)
+    h->ids[to] = h->ids[from];
+  memcpy(h->data + h->data_size * to, h->data + h->data_size * from,
+         h->data_size);
+}
+
+// take slot k out of the bucket starting at first, closing the gap
+static void bucket_remove(hashtab h, uint64_t first, uint64_t k) {
+  uint64_t end = first + h->nprobes;
+  for (; k + 1 < end && h->fitness[k + 1]; k++)
+    move_slot(h, k, k + 1);
+  h->fitness[k] = 0;
+}
+
+// put item in its place in the bucket starting at first, dropping the worst
+// if the bucket is full; false if item is the worst
+static bool bucket_insert(hashtab h, uint64_t first, const char *item,
+                          fitness_t fit, uint64_t hash, uint64_t id) {
+  uint64_t end = first + h->nprobes, k = first;
+  while (k < end && h->fitness[k] &&
+         !better(h, fit, hash, item, h->fitness[k], h->hashes[k],
+                 h->data + h->data_size * k))
+    k++;
+  if (k == end)
+    return false;
+  uint64_t last = end - 1;
+  while (last > k && !h->fitness[last - 1])
+    last--;
+  for (uint64_t j = last; j > k; j--)
+    move_slot(h, j, j - 1);
+  h->fitness[k] = fit;
+  h->hashes[k] = hash;
+  if (h->ids)
+    h->ids[k] = id;
+  memcpy(h->data + h->data_size * k, item, h->data_size);
+  return true;
+}
+
+// insert item in deterministic mode, under its bucket's lock. An item equal
+// to one there keeps the better of the two, so which comes first is no matter.
+// Returns whether item went in.
+static bool ht_probe_det(hashtab h, const char *item, uint64_t myhash,
+                         uint64_t myid, fitness_t myfit) {
+  uint64_t b = bucket_of(h, myhash), first = b * h->nprobes;
+  // the worst of a full bucket only gets better, so a child below it can go
+  // without taking the lock (one that dominates is taken to be as fit)
+  fitness_t worst = h->fitness[first + h->nprobes - 1];
+  if (worst && myfit < worst)
+    return false;
+  while (__sync_lock_test_and_set(h->locks + b, 1)) {
+    count_spin();
+    cpu_relax();
+  }
+  bool placed = true;
+  uint64_t k;
+  for (k = first; k < first + h->nprobes && h->fitness[k]; k++) {
+    if (h->hashes[k] != myhash)
+      continue;
+    char *there = h->data + h->data_size * k;
+    if (same_item(h, item, k, myid)) {
+      if (better(h, myfit, myhash, item, h->fitness[k], myhash, there))
+        bucket_remove(h, first, k);
+      else
+        placed = false;
+      break;
+    }
+    if (h->dominates && h->dominates(there, item)) {
+      placed = false;
+      break;
+    }
+    if (h->dominates && h->dominates(item, there)) {
+      bucket_remove(h, first, k);
+      break;
+    }
+  }
+  if (placed)
+    placed = bucket_insert(h, first, item, myfit, myhash, myid);
+  __sync_lock_release(h->locks + b);
+  if (placed)
+    sink_new(h, item, myfit, myhash, myid);
+  return placed;
+}
 
-static void ht_probe(hashtab h, const char *item) {
-  uint64_t key = h->hash(item);
+// insert item, whose hash is key and identity_hash id; returns whether it went
+// in, even if it pushed out an item that then found no place
+static bool ht_probe(hashtab h, const char *item, uint64_t key, uint64_t id) {
+  uint64_t myhash = key, myid = id;
+  bool fresh = true; // item is the new one, not one it pushed out
+  if (h->closed) {
+    closedset *c = h->closed;
+    if (closed_contains(c, c->key ? c->key(item, myhash) : myhash)) {
+      __sync_fetch_and_add(&c->dropped, 1);
+      return false;
+    }
+  }
+  key ^= h->salt;
   uint64_t key1 = 13 - key % 13;
   fitness_t myfit = h->fitness_func(item);
   if (myfit == stop_fitness)
       earlystop = true;
+  if (deterministic)
+    return ht_probe_det(h, item, myhash, myid, myfit);
   void *tmp_item[2] = {alloca(h->data_size), alloca(h->data_size)};
   int nexttmp = 0;
   bool havelock = false;
@@ -75,6 +407,7 @@ static void ht_probe(hashtab h, const char *item) {
     fitness_t fit;
     fit = h->fitness[key];
     while (fit == IN_USE) {
+      count_spin();
       cpu_relax();
       fit = h->fitness[key];
     }
@@ -83,12 +416,45 @@ static void ht_probe(hashtab h, const char *item) {
       havelock = true;
       if (!fit) {
         memcpy(h->data + h->data_size * key, item, h->data_size);
+        h->hashes[key] = myhash;
+        if (h->ids)
+          h->ids[key] = myid;
         __sync_synchronize();
         h->fitness[key] = myfit;
         //                printf("Unlocked %li %i %i\n",key,
         //                omp_get_thread_num(), myfit);
         //  printf(" into empty slot %i\n",i);
-        return;
+        if (fresh)
+          sink_new(h, item, myfit, myhash, myid);
+        return true;
+      }
+    }
+    // items that dominate one another hash the same, so only those are compared;
+    // in identity mode a duplicate is still found without reading the slot,
+    // but whether one of two different items dominates needs both
+    if (h->dominates && h->hashes[key] == myhash) {
+      if (!havelock) {
+          fit = get_control(h, key, fit);
+        havelock = true;
+      }
+      char *there = h->data + h->data_size * key;
+      __sync_synchronize();
+      if (h->hashes[key] == myhash) {
+        if ((h->identity_hash && same_item(h, item, key, myid)) ||
+            h->dominates(there, item)) {
+          h->fitness[key] = fit;
+          return !fresh;
+        }
+        if (h->dominates(item, there)) {
+          memcpy(there, item, h->data_size);
+          if (h->ids)
+            h->ids[key] = myid;
+          __sync_synchronize();
+          h->fitness[key] = myfit;
+          if (fresh)
+            sink_new(h, item, myfit, myhash, myid);
+          return true;
+        }
       }
     }
     if (fit < myfit || ((i == h->nprobes-1) && fit == myfit )) {
@@ -100,12 +466,24 @@ static void ht_probe(hashtab h, const char *item) {
         __sync_synchronize();
         memcpy(tmp_item[nexttmp], h->data + h->data_size * key, h->data_size);
         memcpy(h->data + h->data_size * key, item, h->data_size);
+        uint64_t tmphash = h->hashes[key];
+        h->hashes[key] = myhash;
+        uint64_t tmpid = 0;
+        if (h->ids) {
+          tmpid = h->ids[key];
+          h->ids[key] = myid;
+        }
         __sync_synchronize();
         h->fitness[key] = myfit;
         //                printf("Unlocked %li %i %i\n",key,
         //                omp_get_thread_num(), myfit);
         havelock = false;
+        if (fresh)
+          sink_new(h, item, myfit, myhash, myid);
+        fresh = false;
         myfit = fit;
+        myhash = tmphash;
+        myid = tmpid;
         item = tmp_item[nexttmp];
         nexttmp ^= 1;
         //printf(" swapped %i ",i);
@@ -121,11 +499,11 @@ static void ht_probe(hashtab h, const char *item) {
       }
       if (fit == myfit) {
         __sync_synchronize();
-        if (h->equal(item, h->data + h->data_size * key)) {
+        if (h->hashes[key] == myhash && same_item(h, item, key, myid)) {
             // printf(" dup %i\n",i);
           h->fitness[key] = fit;
           // printf("Unlocked %li %i %i\n",key, omp_get_thread_num(), fit);
-          return;
+          return !fresh;
         } else {
           h->fitness[key] = fit;
           // printf("Unlocked %li %i %i\n",key, omp_get_thread_num(), fit);
@@ -141,66 +519,869 @@ static void ht_probe(hashtab h, const char *item) {
     key += key1;
   }
   // printf(" ran out\n");
+  return !fresh;
 }
 
 static void probe_multi(hashtab h, const char *items, int nitems) {
   for (int j = 0; j < nitems; j++) {
-    ht_probe(h, items + j * h->data_size);
+    const char *item = items + j * h->data_size;
+    ht_probe(h, item, h->hash(item), identity_of(h, item));
+  }
+}
+
+// Children are inserted in groups of BATCH: hash them all and prefetch the
+// slots each will probe first, then probe them in turn, so that the cache
+// misses of a group overlap instead of following one another.
+#define BATCH 16
+
+static inline void prefetch_slot(const hashtab h, uint64_t hash) {
+  uint64_t key = deterministic ? bucket_of(h, hash) * h->nprobes
+                               : (hash ^ h->salt) % h->tabsize;
+  __builtin_prefetch(h->fitness + key, 1);
+  __builtin_prefetch(h->hashes + key, 1);
+  if (h->ids)
+    __builtin_prefetch(h->ids + key, 1);
+  __builtin_prefetch(h->data + h->data_size * key, 1);
+}
+
+// Each thread's view of the search, passed to visit_children as the context:
+// the table children go to, children waiting to be inserted there, and
+// scratch space that outlives each parent.
+typedef struct {
+  hashtab table;
+  char *batch; // BATCH items
+  uint64_t batch_hash[BATCH];
+  uint64_t batch_id[BATCH];
+  int nbatch;
+  char *scratch;
+  size_t scratch_size;
+  uint64_t skipped_parents, skipped_children; // after a stop
+  uint64_t skipped_ranges; // of a split parent's children, not yet visited at a stop
+  uint64_t pruned; // children whose bound was below best_seen
+  uint64_t offered; // children passed on for insertion this generation
+  uint64_t inserted; // of them, those that went in
+  struct s_capture *cap; // where to record them, in the capture generation
+  char *capbuf;
+  size_t capused;
+} __attribute__((aligned(64))) worker;
+
+// Children of one generation written to a file as they are offered, see
+// capture in beam.h. Each thread fills a buffer of its own and appends it
+// to the file whole.
+#define CAPTURE_BUFFER (1 << 20)
+
+typedef struct s_capture {
+  FILE *f;
+  const char *path;
+  beam_capture_header header;
+} capture;
+
+static void capture_flush(worker *w) {
+  capture *c = w->cap;
+  #pragma omp critical(capture)
+  {
+    fwrite(w->capbuf, 1, w->capused, c->f);
+    c->header.nentries += w->capused / c->header.entry_size;
+  }
+  w->capused = 0;
+}
+
+static void capture_child(worker *w, const char *item, uint64_t hash) {
+  capture *c = w->cap;
+  if (w->capused + c->header.entry_size > CAPTURE_BUFFER)
+    capture_flush(w);
+  char *at = w->capbuf + w->capused;
+  beam_capture_entry *e = (beam_capture_entry *)at;
+  e->hash = hash;
+  e->fitness = w->table->fitness_func(item);
+  e->thread = omp_get_thread_num();
+  memset(at + sizeof(beam_capture_entry), 0,
+         c->header.entry_size - sizeof(beam_capture_entry));
+  memcpy(at + sizeof(beam_capture_entry), item, c->header.data_size);
+  w->capused += c->header.entry_size;
+}
+
+// whether to drop a child before it is batched: after a stop, or when its
+// bound says it can never reach the best fitness already seen
+static inline bool dropped(worker *w, const char *item) {
+  hashtab h = w->table;
+  if (cancelled_for(h, item)) {
+    w->skipped_children++;
+    return true;
+  }
+  if (h->bound) {
+    fitness_t f = h->fitness_func(item), b = best_seen;
+    if (f > b) {
+      if (!deterministic)
+        raise_best(f);
+    }
+    else if (h->bound(item, h->gens_left) < b) {
+      w->pruned++;
+      return true;
+    }
   }
+  return false;
+}
+
+static void flush(worker *w) {
+  for (int j = 0; j < w->nbatch; j++) {
+    const char *item = w->batch + w->table->data_size * j;
+    if (cancelled_for(w->table, item))
+      w->skipped_children++;
+    else {
+      if (w->cap)
+        capture_child(w, item, w->batch_hash[j]);
+      w->inserted += ht_probe(w->table, item, w->batch_hash[j], w->batch_id[j]);
+    }
+  }
+  w->nbatch = 0;
 }
 
 static void visit(const char *item, void *context) {
-  ht_probe((hashtab)context, item);
+  worker *w = (worker *)context;
+  hashtab h = w->table;
+  if (dropped(w, item))
+    return;
+  w->offered++;
+  char *at = w->batch + h->data_size * w->nbatch;
+  memcpy(at, item, h->data_size);
+  uint64_t hash = h->hash(at);
+  w->batch_id[w->nbatch] = identity_of(h, at);
+  w->batch_hash[w->nbatch++] = hash;
+  prefetch_slot(h, hash);
+  if (w->nbatch == BATCH)
+    flush(w);
+}
+
+void beam_visit_batch(const char *items, size_t nitems, void *context) {
+  worker *w = (worker *)context;
+  hashtab h = w->table;
+  uint64_t hashes[BATCH], ids[BATCH];
+  flush(w);
+  for (size_t lo = 0; lo < nitems; lo += BATCH) {
+    size_t n = nitems - lo < BATCH ? nitems - lo : BATCH;
+    const char *group = items + h->data_size * lo;
+    for (size_t j = 0; j < n; j++) {
+      hashes[j] = h->hash(group + h->data_size * j);
+      ids[j] = identity_of(h, group + h->data_size * j);
+      prefetch_slot(h, hashes[j]);
+    }
+    for (size_t j = 0; j < n; j++)
+      if (!dropped(w, group + h->data_size * j)) {
+        w->offered++;
+        if (w->cap)
+          capture_child(w, group + h->data_size * j, hashes[j]);
+        w->inserted += ht_probe(h, group + h->data_size * j, hashes[j], ids[j]);
+      }
+  }
+}
+
+// the flag is the search's, not the thread's: context is not needed
+bool beam_cancelled(void *context) {
+  return earlystop && !deterministic;
+}
+
+void *beam_scratch(void *context, size_t size) {
+  worker *w = (worker *)context;
+  if (size > w->scratch_size) {
+    free(w->scratch);
+    w->scratch_size = (size + 63) & ~(size_t)63;
+    w->scratch = aligned_alloc(64, w->scratch_size);
+  }
+  return w->scratch;
+}
+
+static worker *new_workers(int nworkers, size_t data_size) {
+  worker *workers = aligned_alloc(64, sizeof(worker) * nworkers);
+  memset(workers, 0, sizeof(worker) * nworkers);
+  for (int t = 0; t < nworkers; t++)
+    workers[t].batch = malloc(data_size * BATCH);
+  return workers;
+}
+
+static void free_workers(worker *workers, int nworkers) {
+  for (int t = 0; t < nworkers; t++) {
+    free(workers[t].batch);
+    free(workers[t].scratch);
+    free(workers[t].capbuf);
+  }
+  free(workers);
+}
+
+typedef struct {
+    uint64_t slot;
+    uint64_t lo, hi;
+} task;
+
+// Split the parents of h into ranges of children, so that a generation with
+// only a handful of parents still occupies every thread. Without an explicit
+// chunk size each parent is cut into about 8 pieces per thread.
+static uint64_t chunk_size(const beam_options *opts, uint64_t nch) {
+  if (opts->chunk)
+    return opts->chunk;
+  uint64_t pieces = 8 * omp_get_max_threads();
+  return nch > pieces ? (nch + pieces - 1) / pieces : 1;
+}
+
+// Parents are put in order of fitness by a counting sort into FITBUCKETS
+// buckets spanning the fitnesses present, best first; within a bucket they
+// stay in slot order, so parents of nearly the same fitness may be swapped.
+#define FITBUCKETS 1024
+
+static inline size_t fit_bucket(fitness_t f, fitness_t lo, uint64_t span) {
+  return FITBUCKETS - 1 - (uint64_t)(f - lo) * FITBUCKETS / span;
+}
+
+// the slots of the parents in h, best first if by_fitness is set
+static uint64_t *parent_slots(const hashtab h, bool by_fitness,
+                              size_t *nslots) {
+  size_t n = 0;
+  fitness_t lo = IN_USE, hi = 0;
+  for (size_t i = 0; i < h->tabsize; i++) {
+    fitness_t f = h->fitness[i];
+    if (f) {
+      n++;
+      lo = f < lo ? f : lo;
+      hi = f > hi ? f : hi;
+    }
+  }
+  uint64_t *slots = malloc(sizeof(uint64_t) * (n ? n : 1));
+  *nslots = n;
+  if (!by_fitness) {
+    n = 0;
+    for (size_t i = 0; i < h->tabsize; i++)
+      if (h->fitness[i])
+        slots[n++] = i;
+    return slots;
+  }
+  uint64_t span = (uint64_t)hi - lo + 1;
+  size_t start[FITBUCKETS + 1] = {0};
+  for (size_t i = 0; i < h->tabsize; i++)
+    if (h->fitness[i])
+      start[fit_bucket(h->fitness[i], lo, span) + 1]++;
+  for (int b = 0; b < FITBUCKETS; b++)
+    start[b + 1] += start[b];
+  for (size_t i = 0; i < h->tabsize; i++)
+    if (h->fitness[i])
+      slots[start[fit_bucket(h->fitness[i], lo, span)]++] = i;
+  return slots;
+}
+
+static task *split_parents(const hashtab h, const beam_options *opts,
+                           size_t *ntasks) {
+  size_t nslots, n = 0;
+  uint64_t *slots = parent_slots(h, opts->fittest_first, &nslots);
+  for (size_t k = 0; k < nslots; k++) {
+    uint64_t nch = opts->count_children(h->data + h->data_size * slots[k]);
+    uint64_t chunk = chunk_size(opts, nch);
+    n += (nch + chunk - 1) / chunk;
+  }
+  task *tasks = malloc(sizeof(task) * (n ? n : 1));
+  n = 0;
+  for (size_t k = 0; k < nslots; k++) {
+    uint64_t nch = opts->count_children(h->data + h->data_size * slots[k]);
+    uint64_t chunk = chunk_size(opts, nch);
+    for (uint64_t lo = 0; lo < nch; lo += chunk) {
+      tasks[n].slot = slots[k];
+      tasks[n].lo = lo;
+      tasks[n].hi = (lo + chunk < nch) ? lo + chunk : nch;
+      n++;
+    }
+  }
+  free(slots);
+  *ntasks = n;
+  return tasks;
+}
+
+// expand the parent in slot i of h, unless the search has been stopped
+static inline void expand(const hashtab h, size_t i,
+                          void visit_children(const char *,
+                                              void (*visit)(const char *, void *),
+                                              void *),
+                          worker *w) {
+  if (earlystop && !deterministic) {
+    w->skipped_parents++;
+    return;
+  }
+  visit_children((char *)(h->data + h->data_size * i), visit, w);
+  flush(w);
 }
 
 static hashtab nextgen(const hashtab h,
                        void visit_children(const char *,
                                            void (*visit)(const char *, void *),
                                            void *),
-                       int beamsize) {
+                       int beamsize, const beam_options *opts,
+                       worker *workers, int nworkers) {
   hashtab newtab = new_ht(h->data_size, beamsize, h->fitness_func, h->equal,
-                          h->hash, h->nprobes, h->print_item);
+                          h->hash, h->identity_hash, h->nprobes, h->print_item,
+                          h->dominates);
+  newtab->verify = h->verify;
+  newtab->bound = h->bound;
+  newtab->gens_left = h->gens_left - 1;
+  newtab->salt = h->salt;
+  newtab->sink = h->sink;
+  newtab->sink_threshold = h->sink_threshold;
+  newtab->sunk = h->sunk;
+  newtab->gen = h->gen + 1;
+  for (int t = 0; t < nworkers; t++)
+    workers[t].table = newtab;
+  if (h->closed) {
+    closedset *c = h->closed;
+    newtab->closed = c;
+    // a full closed set forgets according to the order of additions
+    #pragma omp parallel for if (!deterministic)
+    for (size_t i = 0; i < h->tabsize; i++)
+      if (h->fitness[i] != 0)
+        closed_add(c, c->key ? c->key(h->data + h->data_size * i, h->hashes[i])
+                             : h->hashes[i]);
+    for (size_t i = 0; i < h->tabsize; i++)
+      c->added += h->fitness[i] != 0;
+  }
+  // in deterministic mode too: the buckets end up the same in any order
+  if (opts->visit_children_range) {
+    size_t nparents = 0;
+    for (size_t i = 0; i < h->tabsize; i++)
+      if (h->fitness[i] != 0)
+        nparents++;
+    if (nparents < 4 * omp_get_max_threads()) {
+      size_t ntasks;
+      task *tasks = split_parents(h, opts, &ntasks);
+      #pragma omp parallel for schedule(dynamic, 1)
+      for (size_t t = 0; t < ntasks; t++) {
+        worker *w = workers + omp_get_thread_num();
+        if (earlystop && !deterministic) {
+          w->skipped_ranges++;
+          continue;
+        }
+        opts->visit_children_range(h->data + h->data_size * tasks[t].slot,
+                                   tasks[t].lo, tasks[t].hi, visit, w);
+        flush(w);
+      }
+      free(tasks);
+      return newtab;
+    }
+  }
+  if (opts->fittest_first) {
+    // threads take the next few parents as they finish, so the best go first
+    size_t nslots;
+    uint64_t *slots = parent_slots(h, opts->fittest_first, &nslots);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t k = 0; k < nslots; k++)
+      expand(h, slots[k], visit_children, workers + omp_get_thread_num());
+    free(slots);
+    return newtab;
+  }
      #pragma omp parallel for
   for (int i = 0; i < h->tabsize; i++) {
     if (h->fitness[i] != 0) {
         //        h->print_item((char *)(h->data + h->data_size * i));
         //        printf("\n");
-              visit_children((char *)(h->data + h->data_size * i), visit, newtab);
+        expand(h, i, visit_children, workers + omp_get_thread_num());
     }
   }
   return newtab;
 }
 
+// how much of generation gen was left undone when a stop_fitness item was
+// found while expanding the parents in h
+static void print_stop(int gen, const hashtab h, const worker *workers,
+                       int nworkers) {
+  uint64_t nparents = 0, parents = 0, children = 0, ranges = 0;
+  for (size_t i = 0; i < h->tabsize; i++)
+    nparents += h->fitness[i] != 0;
+  for (int t = 0; t < nworkers; t++) {
+    parents += workers[t].skipped_parents;
+    children += workers[t].skipped_children;
+    ranges += workers[t].skipped_ranges;
+  }
+  // a range is of child indices, which need not be one child each
+  printf("Stopped in generation %i: %lu of %lu parents, %lu children and %lu "
+         "child ranges skipped\n", gen, parents, nparents, children, ranges);
+}
+
+static size_t count_items(const hashtab h) {
+  size_t n = 0;
+  for (size_t i = 0; i < h->tabsize; i++)
+    n += h->fitness[i] != 0;
+  return n;
+}
+
+static size_t slot_bytes(const hashtab h) {
+  return sizeof(fitness_t) + sizeof(uint64_t) * (h->ids ? 2 : 1) + h->data_size;
+}
+
+// Width of the next table under a memory or time budget, from what the
+// generation that just filled h did: nparents parents made offered children,
+// nitems of them distinct (or fewer, if the table filled up), in gen_time
+// seconds. Aims at twice as many slots as the next generation should make
+// distinct children, within half the memory (h takes the other half) and the
+// time left for the gens_to_go generations still to expand. An island search
+// gives each of its islands a share of the beam and the memory.
+static size_t next_width(const beam_options *opts, size_t beamsize, int share,
+                         const hashtab h, uint64_t nparents, uint64_t offered,
+                         double gen_time, double elapsed, int gens_to_go) {
+  size_t nitems = count_items(h), want;
+  if (!offered)
+    want = h->tabsize;
+  else {
+    double branching = (double)offered / nparents;
+    // in a crowded table many distinct children were lost, so assume all were
+    double distinct = 2 * nitems > h->tabsize ? 1 : (double)nitems / offered;
+    want = 2 * branching * nitems * distinct;
+  }
+  size_t cap = beamsize / share;
+  if (opts->memory_budget)
+    cap = opts->memory_budget / share / 2 / slot_bytes(h);
+  if (opts->deadline > 0 && gens_to_go > 0 && nparents) {
+    double left = opts->deadline - elapsed, per_parent = gen_time / nparents;
+    double fits = left > 0 ? left / (gens_to_go * per_parent) : 0;
+    if (fits < cap)
+      cap = fits;
+  }
+  if (want > cap)
+    want = cap;
+  return want < 17 ? 17 : want;
+}
+
+void beam_default_options(beam_options *opts) {
+  memset(opts, 0, sizeof(beam_options));
+}
+
+// One of the beams of an island search, or the only one, with its share of
+// the threads.
+typedef struct {
+  hashtab current;
+  worker *workers;
+  int nworkers;
+  size_t width;
+} island;
+
+// run generation gen of one island
+static void island_gen(island *is, int gen, int ngens, int share,
+                       void visit_children(const char *,
+                                           void (*visit)(const char *, void *),
+                                           void *),
+                       int beamsize, const beam_options *opts, double start) {
+  double t0 = omp_get_wtime();
+  hashtab next = nextgen(is->current, visit_children, is->width, opts,
+                         is->workers, is->nworkers);
+  if (earlystop)
+    print_stop(gen, is->current, is->workers, is->nworkers);
+  if (opts->memory_budget || opts->deadline > 0) {
+    uint64_t offered = 0;
+    for (int t = 0; t < is->nworkers; t++)
+      offered += is->workers[t].offered;
+    double now = omp_get_wtime();
+    is->width = next_width(opts, beamsize, share, next, count_items(is->current),
+                           offered, now - t0, now - start, ngens - gen - 1);
+  }
+  free_ht(is->current);
+  is->current = next;
+}
+
+// clear the workers' counts of children for the next generation; with BENCH,
+// first print them for the one just run, which took secs
+static void reset_counts(island *islands, int nislands, int gen, double secs) {
+#ifdef BENCH
+  uint64_t offered = 0, inserted = 0, kept = 0;
+  for (int k = 0; k < nislands; k++) {
+    kept += count_items(islands[k].current);
+    for (int t = 0; t < islands[k].nworkers; t++) {
+      offered += islands[k].workers[t].offered;
+      inserted += islands[k].workers[t].inserted;
+    }
+  }
+  printf("Bench: generation %i, %lu children, %lu inserted, %lu kept, %.6f s\n",
+         gen, offered, inserted, kept, secs);
+#endif
+  for (int k = 0; k < nislands; k++)
+    for (int t = 0; t < islands[k].nworkers; t++)
+      islands[k].workers[t].offered = islands[k].workers[t].inserted = 0;
+}
+
+// open the capture of generation gen of the island, or if that fails say so
+// and return NULL
+static capture *start_capture(const beam_options *opts, int gen, island *is) {
+  capture *c = calloc(1, sizeof(capture));
+  c->path = opts->capture;
+  c->f = fopen(c->path, "wb");
+  if (!c->f) {
+    perror(c->path);
+    free(c);
+    return NULL;
+  }
+  beam_capture_header *h = &c->header;
+  memcpy(h->magic, BEAM_CAPTURE_MAGIC, sizeof(h->magic));
+  h->version = BEAM_CAPTURE_VERSION;
+  h->data_size = is->current->data_size;
+  h->entry_size = sizeof(beam_capture_entry) + ((h->data_size + 7) & ~(uint64_t)7);
+  h->tabsize = is->width;
+  h->nprobes = is->current->nprobes;
+  h->gen = gen;
+  fwrite(h, sizeof(*h), 1, c->f);
+  for (int t = 0; t < is->nworkers; t++) {
+    is->workers[t].cap = c;
+    is->workers[t].capbuf = malloc(CAPTURE_BUFFER);
+    is->workers[t].capused = 0;
+  }
+  return c;
+}
+
+// write out what the threads still hold and the final header
+static void end_capture(capture *c, island *is) {
+  for (int t = 0; t < is->nworkers; t++) {
+    capture_flush(is->workers + t);
+    is->workers[t].cap = NULL;
+  }
+  fseek(c->f, 0, SEEK_SET);
+  fwrite(&c->header, sizeof(c->header), 1, c->f);
+  if (ferror(c->f) | fclose(c->f))
+    perror(c->path);
+  else
+    printf("Captured %lu children of generation %li in %s\n",
+           c->header.nentries, c->header.gen, c->path);
+  free(c);
+}
+
+// pass the best item of the generation just made to the sink
+static void sink_best(const island *islands, int nislands) {
+  hashtab best = NULL;
+  size_t at = 0;
+  for (int k = 0; k < nislands; k++) {
+    const hashtab h = islands[k].current;
+    for (size_t i = 0; i < h->tabsize; i++)
+      if (h->fitness[i] && (!best || h->fitness[i] > best->fitness[at])) {
+        best = h;
+        at = i;
+      }
+  }
+  if (best)
+    best->sink(best->data + best->data_size * at, best->gen, true);
+}
+
+// copy the best migrants items of each island into the next one round the ring
+static void migrate(island *islands, int nislands, int migrants) {
+  size_t data_size = islands[0].current->data_size;
+  char *moving = malloc(data_size * migrants * nislands);
+  int nmoving[nislands];
+  for (int k = 0; k < nislands; k++) {
+    const hashtab h = islands[k].current;
+    size_t nslots;
+    uint64_t *slots = parent_slots(h, true, &nslots);
+    nmoving[k] = nslots < migrants ? nslots : migrants;
+    for (int j = 0; j < nmoving[k]; j++)
+      memcpy(moving + data_size * (k * migrants + j),
+             h->data + h->data_size * slots[j], data_size);
+    free(slots);
+  }
+  for (int k = 0; k < nislands; k++)
+    probe_multi(islands[(k + 1) % nislands].current,
+                moving + data_size * k * migrants, nmoving[k]);
+  free(moving);
+}
+
 char *
-beam_search(const char *seeds, int nseeds,
-            void visit_children(const char *,
-                                void (*visit)(const char *, void *), void *),
-            int beamsize, int ngens, size_t data_size,
-            fitness_t fitness_func(const char *),
-            bool equal(const char *, const char *), uint64_t hash(const char *),
-            int nprobes, void print_item(const char *), size_t *nresults) {
-  hashtab current = new_ht(data_size, beamsize, fitness_func, equal, hash,
-                           nprobes, print_item);
-  probe_multi(current, seeds, nseeds);
+beam_search_opts(const beam_options *opts, const char *seeds, int nseeds,
+                 void visit_children(const char *,
+                                     void (*visit)(const char *, void *), void *),
+                 int beamsize, int ngens, size_t data_size,
+                 fitness_t fitness_func(const char *),
+                 bool equal(const char *, const char *),
+                 uint64_t hash(const char *), int nprobes,
+                 void print_item(const char *), size_t *nresults) {
+  beam_options defaults;
+  if (!opts) {
+    beam_default_options(&defaults);
+    opts = &defaults;
+  }
+  deterministic = opts->deterministic;
+  int nislands = opts->islands > 1 ? opts->islands : 1;
+  int nthreads = omp_get_max_threads();
+  // islands nest their workers' regions; the caller's setting is put back at the end
+  int levels = omp_get_max_active_levels();
+  if (nislands > 1)
+    omp_set_max_active_levels(2);
+  island *islands = calloc(nislands, sizeof(island));
+  id_matches = id_collisions = 0;
+  best_seen = 0;
+  for (int i = 0; i < nseeds; i++)
+    raise_best(fitness_func(seeds + i * data_size));
+  // room for a few times the items the tables hold, since items come and go,
+  // and for a good many more in a small beam
+  size_t sunk_bytes = (size_t)16 * beamsize > 1 << 20 ? (size_t)16 * beamsize : 1 << 20;
+  closedset *sunk = opts->sink ? new_closed(sunk_bytes, NULL) : NULL;
+  for (int k = 0; k < nislands; k++) {
+    island *is = islands + k;
+    hashtab current = new_ht(data_size, beamsize / nislands, fitness_func, equal,
+                             hash, opts->identity_hash, nprobes, print_item,
+                             opts->dominates);
+    current->verify = opts->verify_identity;
+    current->bound = opts->bound;
+    current->gens_left = ngens;
+    current->salt = k * 0x9E3779B97F4A7C15ULL;
+    current->sink = opts->sink;
+    current->sink_threshold = opts->sink_threshold;
+    current->sunk = sunk;
+    // with enough seeds each island starts from its own
+    if (nseeds >= nislands) {
+      for (int i = k; i < nseeds; i += nislands)
+        probe_multi(current, seeds + i * data_size, 1);
+    } else
+      probe_multi(current, seeds, nseeds);
+    if (opts->closed_bytes)
+      current->closed =
+          new_closed(opts->closed_bytes / nislands, opts->closed_key);
+    is->current = current;
+    // the first nthreads % nislands islands get a thread more
+    int threads = nthreads / nislands + (k < nthreads % nislands);
+    is->nworkers = threads > 0 ? threads : 1;
+    is->workers = new_workers(is->nworkers, data_size);
+    is->width = current->tabsize;
+    size_t share = opts->memory_budget / nislands / 2;
+    if (opts->memory_budget && is->width * slot_bytes(current) > share)
+      is->width = share / slot_bytes(current);
+  }
   earlystop = false;
+  bool adaptive = opts->memory_budget || opts->deadline > 0;
+  double start = omp_get_wtime();
   for (int i = 0; i < ngens; i++) {
       printf("GENERATION %i\n", i);
-    hashtab next = nextgen(current, visit_children, beamsize);
-    free_ht(current);
-    current = next;
+    double gen_start = omp_get_wtime();
+    if (adaptive) {
+      printf("Width");
+      for (int k = 0; k < nislands; k++)
+        printf(" %lu", islands[k].width);
+      printf("\n");
+    }
+    capture *cap = opts->capture && i == opts->capture_gen
+                       ? start_capture(opts, i, islands) : NULL;
+    if (sunk)
+      memset(sunk->buckets, 0, (sunk->mask + 1) * sizeof(uint64_t));
+    #pragma omp parallel for num_threads(nislands) if (nislands > 1)
+    for (int k = 0; k < nislands; k++) {
+      if (nislands > 1)
+        omp_set_num_threads(islands[k].nworkers);
+      island_gen(islands + k, i, ngens, nislands, visit_children, beamsize,
+                 opts, start);
+    }
+    reset_counts(islands, nislands, i, omp_get_wtime() - gen_start);
+    if (cap)
+      end_capture(cap, islands);
+    if (opts->sink)
+      sink_best(islands, nislands);
+    if (deterministic && opts->bound)
+      for (int k = 0; k < nislands; k++) {
+        const hashtab h = islands[k].current;
+        for (size_t j = 0; j < h->tabsize; j++)
+          raise_best(h->fitness[j]);
+      }
     if (earlystop)
         break;
+    if (opts->deadline > 0 && omp_get_wtime() - start >= opts->deadline &&
+        i < ngens - 1) {
+      printf("Deadline reached after generation %i\n", i);
+      break;
+    }
+    if (nislands > 1 && opts->migrate_every && (i + 1) % opts->migrate_every == 0 &&
+        i < ngens - 1)
+      migrate(islands, nislands, opts->migrants);
   }
-  char *results = malloc(data_size * current->tabsize);
+  // after a stop just the items that caused it
+  size_t room = 0;
+  for (int k = 0; k < nislands; k++)
+    room += islands[k].current->tabsize;
+  char *results = malloc(data_size * room);
   int nres = 0;
-  for (int i = 0; i < current->tabsize; i++) {
-    if (current->fitness[i]) {
-      memcpy(results + nres * data_size, current->data + i * data_size,
-             data_size);
-      nres++;
+  uint64_t pruned = 0;
+  for (int k = 0; k < nislands; k++) {
+    hashtab current = islands[k].current;
+    for (int i = 0; i < current->tabsize; i++) {
+      if (current->fitness[i] &&
+          (!earlystop || current->fitness[i] == stop_fitness)) {
+        memcpy(results + nres * data_size, current->data + i * data_size,
+               data_size);
+        nres++;
+      }
     }
+    for (int t = 0; t < islands[k].nworkers; t++)
+      pruned += islands[k].workers[t].pruned;
   }
   *nresults = nres;
-  free_ht(current);
+#ifdef BENCH
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("Bench: peak RSS %ld kB\n", usage.ru_maxrss);
+#endif
+  if (opts->bound)
+    printf("Bound: %lu children pruned below fitness %u\n", pruned, best_seen);
+  if (opts->verify_identity)
+    printf("Hash identity: %lu duplicates found by hash, %lu of them collisions\n",
+           id_matches, id_collisions);
+  for (int k = 0; k < nislands; k++) {
+    if (islands[k].current->closed) {
+      print_closed(islands[k].current->closed);
+      free_closed(islands[k].current->closed);
+    }
+    free_ht(islands[k].current);
+    free_workers(islands[k].workers, islands[k].nworkers);
+  }
+  free(islands);
+  if (sunk)
+    free_closed(sunk);
+  omp_set_max_active_levels(levels);
   return results;
 }
+
+char *
+beam_search(const char *seeds, int nseeds,
+            void visit_children(const char *,
+                                void (*visit)(const char *, void *), void *),
+            int beamsize, int ngens, size_t data_size,
+            fitness_t fitness_func(const char *),
+            bool equal(const char *, const char *), uint64_t hash(const char *),
+            int nprobes, void print_item(const char *), size_t *nresults) {
+  return beam_search_opts(NULL, seeds, nseeds, visit_children, beamsize, ngens,
+                          data_size, fitness_func, equal, hash, nprobes,
+                          print_item, nresults);
+}
+
+beam_table beam_table_new(const beam_options *opts, size_t data_size,
+                          size_t tabsize, fitness_t fitness_func(const char *),
+                          bool equal(const char *, const char *),
+                          uint64_t hash(const char *), int nprobes) {
+  beam_options defaults;
+  if (!opts) {
+    beam_default_options(&defaults);
+    opts = &defaults;
+  }
+  deterministic = opts->deterministic;
+  hashtab h = new_ht(data_size, tabsize, fitness_func, equal, hash,
+                     opts->identity_hash, nprobes, NULL, opts->dominates);
+  h->verify = opts->verify_identity;
+  return h;
+}
+
+bool beam_table_insert(beam_table t, const char *item) {
+  return ht_probe(t, item, t->hash(item), identity_of(t, item));
+}
+
+size_t beam_table_count(beam_table t) { return count_items(t); }
+
+void beam_table_free(beam_table t) { free_ht(t); }
+
+uint64_t beam_table_spins(void) {
+#ifdef BENCH
+  return spins;
+#else
+  return 0;
+#endif
+}
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+#define SAMPLE 16 // time one insert in this many
+
+void beam_table_time(beam_table t, const char *label, const char *items,
+                     size_t stride, uint64_t n, int threads) {
+  double *lat = malloc(sizeof(double) * (n / SAMPLE + threads + 1));
+  uint64_t nlat = 0, went_in = 0, spins = 0;
+  double start = omp_get_wtime();
+  #pragma omp parallel num_threads(threads) reduction(+ : went_in, spins)
+  {
+    uint64_t spins0 = beam_table_spins();
+    #pragma omp for schedule(static)
+    for (uint64_t g = 0; g < n; g++) {
+      const char *item = items + stride * g;
+      if (g % SAMPLE) {
+        went_in += beam_table_insert(t, item);
+        continue;
+      }
+      double t0 = now_ns();
+      went_in += beam_table_insert(t, item);
+      double t1 = now_ns();
+      lat[__sync_fetch_and_add(&nlat, 1)] = t1 - t0;
+    }
+    spins += beam_table_spins() - spins0;
+  }
+  double secs = omp_get_wtime() - start;
+  qsort(lat, nlat, sizeof(double), cmp_double);
+  if (!nlat)
+    lat[nlat++] = 0;
+  // spins are only counted in a BENCH build
+  char spun[32] = "n/a";
+#ifdef BENCH
+  snprintf(spun, sizeof(spun), "%.4f", n ? (double)spins / n : 0);
+#endif
+  printf("%s\t%i\t%.0f\t%.3f\t%lu\t%s\t%.0f\t%.0f\t%.0f\t%.0f\n", label,
+         threads, n / secs, n ? (double)went_in / n : 0, beam_table_count(t),
+         spun, lat[nlat / 2], lat[nlat * 99 / 100], lat[nlat * 999 / 1000],
+         lat[nlat - 1]);
+  free(lat);
+}
+
+int beam_replay(const beam_options *opts, const char *path, size_t data_size,
+                fitness_t fitness_func(const char *),
+                bool equal(const char *, const char *),
+                uint64_t hash(const char *)) {
+  beam_capture_header h;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+  char *entries = NULL;
+  const char *why = NULL;
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      memcmp(h.magic, BEAM_CAPTURE_MAGIC, sizeof(h.magic)) ||
+      h.version != BEAM_CAPTURE_VERSION)
+    why = "not a capture";
+  else if (h.data_size != data_size)
+    why = "captured with another object size";
+  else {
+    entries = malloc(h.entry_size * (h.nentries ? h.nentries : 1));
+    if (fread(entries, h.entry_size, h.nentries, f) != h.nentries)
+      why = "truncated";
+  }
+  fclose(f);
+  if (why) {
+    fprintf(stderr, "%s: %s\n", path, why);
+    free(entries);
+    return -1;
+  }
+  beam_options o;
+  if (opts)
+    o = *opts;
+  else
+    beam_default_options(&o);
+  printf("# %s: generation %li, %lu slots, %u probes, %lu inserts\n", path,
+         h.gen, h.tabsize, h.nprobes, h.nentries);
+  printf(BEAM_TABLE_COLUMNS);
+  int most = omp_get_max_threads();
+  for (int det = 0; det < 2; det++) {
+    o.deterministic = det;
+    for (int threads = 1;; threads *= 2) {
+      if (threads > most)
+        threads = most;
+      beam_table t = beam_table_new(&o, data_size, h.tabsize, fitness_func,
+                                    equal, hash, h.nprobes);
+      beam_table_time(t, det ? "bucket" : "probe",
+                      entries + sizeof(beam_capture_entry), h.entry_size,
+                      h.nentries, threads);
+      beam_table_free(t);
+      if (threads == most)
+        break;
+    }
+  }
+  free(entries);
+  return 0;
+}
@@ -9,7 +9,7 @@ generally only written to while being created.  Such an array needs a separate i
 Parameters: seed and nseeds are the starting objects
             visit_children is called by the search with a parent object a visit function and a context (void *)
                         it should call the visit function on each child of the parent, passing the context as
-                        the second argument.
+                        the second argument. The context also gives the thread's scratch space, see beam_scratch.
             beamsize is the number of objects held in each generation
             ngens is the number of deearch generations to run.
             data_size is the size in bytes of an object
@@ -28,14 +28,207 @@ the return value is the array of returned objects.
 */
 
 #define stop_fitness 0xFFFFFFFE // any object with this fitness is considered "perfect"
-// when it is discovered the search is terminated at the end of the current generation
+// when it is discovered the search is stopped at once, see beam_cancelled
 // if you don't want this, just never use this fitness value.a
 
 typedef uint32_t fitness_t;
 
+/* Scratch space for visit_children and visit_children_range, from the context they were passed: at least
+   size bytes, 64-byte aligned, belonging to the calling thread and kept from one parent to the next for the
+   whole search. Asking for more than before may move it, so ask once per parent and carve it up.
+*/
+extern void *beam_scratch(void *context, size_t size);
+
+/* Children can also be handed over nitems at a time, laid out data_size apart, instead of one by one
+   through visit: beam_visit_batch(items, nitems, context) with the context visit_children was given.
+   Insertion is batched either way; this saves copying each child into the batch.
+*/
+extern void beam_visit_batch(const char *items, size_t nitems, void *context);
+
+/* Once an object of stop_fitness has been inserted, the search stops expanding: every thread skips the
+   parents it has left, children of any other fitness are dropped, and only the stop_fitness objects are
+   returned, with a note of how much was skipped. beam_cancelled(context) says whether that has happened,
+   so visit_children can give up part way through a parent with many children. It reads a flag of the
+   search, not of context, and there is one for the whole process, so it is only meaningful while a single
+   search runs.
+*/
+extern bool beam_cancelled(void *context);
+
 extern char *beam_search(
     const char *seeds, int nseeds,
     void visit_children(const char *, void (*)(const char *, void *), void *),
     int beamsize, int ngens, size_t data_size, fitness_t fitness(const char *),
     bool equal(const char *, const char *), uint64_t hash(const char *),
     int nprobes, void print_item(const char *), size_t *nresults);
+
+/* Optional behaviour of the search, passed to beam_search_opts. Start from beam_default_options
+   and set what you need; beam_search is beam_search_opts with the defaults.
+
+            count_children and visit_children_range let the search split the children of a single
+                      parent between threads. count_children returns the size of an index space
+                      covering all the children of a parent, visit_children_range visits those
+                      with index in [lo,hi). Used when a generation has too few parents to keep
+                      all threads busy (typically the first few generations).
+            chunk is the number of child indices handed to a thread at a time (0 for a default)
+            dominates, if set, says whether its first argument is at least as good as its second in
+                      every way that matters, so the second need not be kept. Items that dominate one
+                      another must hash the same. A new item dominated by one already in the table
+                      is dropped, and one that dominates an item in the table takes its place.
+                      Like duplicate detection this only looks at the slots the new item probes.
+            closed_bytes, if not 0, keeps a closed set of items already expanded across generations in
+                      about that many bytes, and drops children found in it before insertion. The set
+                      holds fingerprints of closed_key(item, hash(item)), or just of the hash if that is
+                      NULL, so it can forget items when full and now and then wrongly drop one; its fill,
+                      how many fingerprints it forgot and its false positive rate are printed at the end
+                      of the search.
+            identity_hash, if set, is a second hash, independent of hash, and the two together are
+                      taken as an item's identity: equal is never called, and duplicates are found
+                      without reading the items in the table. (With dominates, an item with the same
+                      hash as one in the table but another identity is still read, since only the two
+                      items can say whether one dominates the other.) Two different items with the same 128 bit
+                      identity are (very rarely) taken as one. With verify_identity each duplicate so
+                      found is also checked with equal, and the count of collisions printed at the end.
+            fittest_first expands the parents of each generation roughly in order of decreasing
+                      fitness, threads taking a few at a time from the front, so that a stop_fitness
+                      child of a strong parent is found before the weak parents are expanded.
+            bound, if set, gives an upper bound on the fitness an item or any of its descendants can
+                      reach in the given number of further generations. The search keeps the best
+                      fitness of any child so far and drops, before insertion, children whose bound is
+                      below it. That is only safe if a child is never less fit than its parent, and
+                      bound should return stop_fitness for an item that might reach it.
+            memory_budget and deadline, if not 0, let the width of each generation's table vary:
+                      from beamsize at first, it is then set from how many distinct children the last
+                      generation made, kept within memory_budget bytes for the two tables alive at a
+                      time (and not above beamsize without one) and small enough for the remaining
+                      generations to fit in deadline seconds from the start. The width is printed with
+                      each generation, and the search ends early if the deadline passes.
+            islands, if more than 1, runs that many beams side by side, each with its own table of
+                      beamsize/islands objects and its share of the threads (as even as can be, but at
+                      least one), and with the seeds dealt
+                      out between them if there are enough. Every migrate_every generations the best
+                      migrants objects of each island are copied into the next, round a ring. The
+                      results are those of all the islands together. The islands' workers run in nested
+                      parallel regions, so OpenMP's max active levels is 2 during the search, and is set
+                      back to the caller's value when it returns.
+            sink, if set, is handed results while the search runs, as sink(item, gen, best) with gen
+                      the generation of item, the seeds being 0. Each new item of fitness at least
+                      sink_threshold is passed, with best false, by the thread that inserts it, just
+                      after it goes into the table (so sink must be thread safe, and may later see the
+                      item squeezed out by better ones). An item goes in once per generation as far as
+                      the sink knows: one squeezed out and put back, or moved to another island, is not
+                      passed again, going by a fingerprint of its hash and identity (so, rarely, a new
+                      item whose fingerprint is taken is not passed, or one whose fingerprint was
+                      forgotten in a crowded generation is passed again). When each generation is finished
+                      its best item is passed once more with best true.
+            deterministic makes the results a function of the inputs alone, whatever the number of
+                      threads or the order they run in (provided visit_children is deterministic). Each
+                      object can only go in a bucket of nprobes slots chosen by its hash, which keeps the
+                      best distinct objects offered to it by fitness, then hash, then their bytes (an object
+                      that dominates another should be at least as fit). Every byte of an object then
+                      counts, so visit_children must write all of them, padding included (zero the
+                      child first). Splitting single parents between threads stays on.
+                      A stop_fitness object ends the search at the end of its generation, bound is
+                      checked against the best fitness of the generations before, and the closed set
+                      is filled by one thread. A deadline still depends on timing.
+            capture, if set, is a file to write the children offered for insertion in generation
+                      capture_gen (counting from 0, as printed) to, in the order they come, for
+                      beam_replay to insert into the table alone. With islands only the first is
+                      captured.
+*/
+
+typedef struct s_beam_options {
+    uint64_t (*count_children)(const char *);
+    void (*visit_children_range)(const char *, uint64_t, uint64_t,
+                                 void (*)(const char *, void *), void *);
+    uint64_t chunk;
+    bool (*dominates)(const char *, const char *);
+    size_t closed_bytes;
+    uint64_t (*closed_key)(const char *, uint64_t);
+    uint64_t (*identity_hash)(const char *);
+    bool verify_identity;
+    bool fittest_first;
+    fitness_t (*bound)(const char *, int);
+    size_t memory_budget;
+    double deadline;
+    int islands;
+    int migrate_every;
+    int migrants;
+    void (*sink)(const char *, int, bool);
+    fitness_t sink_threshold;
+    bool deterministic;
+    const char *capture;
+    int capture_gen;
+} beam_options;
+
+extern void beam_default_options(beam_options *opts);
+
+extern char *beam_search_opts(
+    const beam_options *opts, const char *seeds, int nseeds,
+    void visit_children(const char *, void (*)(const char *, void *), void *),
+    int beamsize, int ngens, size_t data_size, fitness_t fitness(const char *),
+    bool equal(const char *, const char *), uint64_t hash(const char *),
+    int nprobes, void print_item(const char *), size_t *nresults);
+
+/* A capture file is a beam_capture_header then nentries entries of entry_size bytes, each a
+   beam_capture_entry followed by the child's data_size bytes, zero padded to 8. Each thread's entries are
+   in the order it offered them, in runs of about 1MB between threads. thread is the thread's number in
+   the search, and tabsize and nprobes are those of the table the children went into.
+*/
+#define BEAM_CAPTURE_MAGIC "BEAMCAPT"
+#define BEAM_CAPTURE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nprobes;
+    uint64_t data_size;
+    uint64_t entry_size;
+    uint64_t tabsize;
+    int64_t gen;
+    uint64_t nentries;
+} beam_capture_header;
+
+typedef struct {
+    uint64_t hash;
+    fitness_t fitness;
+    uint32_t thread;
+} beam_capture_entry;
+
+/* The table each generation's children go into, on its own, to measure insertion apart from any driver
+   (see tablebench.c). beam_table_new makes an empty table of about tabsize slots, taking from opts (NULL
+   for the defaults) what bears on insertion: dominates, identity_hash, verify_identity and deterministic,
+   which like beam_search_opts it sets for the whole library. beam_table_insert inserts item as the search
+   would a child, from any thread, and says whether it went in; beam_table_count counts the items held.
+   In a library built with BENCH, beam_table_spins is how many times the calling thread so far has retried
+   a compare and swap or waited for a slot or bucket another thread held, and otherwise 0.
+*/
+typedef struct s_hashtab *beam_table;
+
+extern beam_table beam_table_new(const beam_options *opts, size_t data_size, size_t tabsize,
+                                 fitness_t fitness(const char *), bool equal(const char *, const char *),
+                                 uint64_t hash(const char *), int nprobes);
+extern bool beam_table_insert(beam_table t, const char *item);
+extern size_t beam_table_count(beam_table t);
+extern void beam_table_free(beam_table t);
+extern uint64_t beam_table_spins(void);
+
+/* Timing inserts into a table, apart from any search. beam_table_time inserts the n items at items,
+   stride bytes apart, into t from threads threads, sharing them out in runs, and prints a line of the
+   columns of BEAM_TABLE_COLUMNS starting with label: inserts per second, the share that went in, items
+   held at the end, spins per insert (see beam_table_spins; n/a without BENCH) and latencies of one insert in 16 at the 50th,
+   99th and 99.9th percentiles and the maximum, in ns.
+
+   beam_replay reads a capture made with the same object layout, and times inserting its children, for
+   the default table then the deterministic one at 1, 2, 4, ... threads up to the maximum, into tables
+   made as beam_table_new does from opts and the object functions, with the size and probes of the
+   captured one. So a driver can replay what it captured with its own equal, dominates and so on.
+   Returns 0, or -1 (with a message on stderr) if the file is not such a capture.
+*/
+#define BEAM_TABLE_COLUMNS \
+    "engine\tthreads\tinserts_per_s\twent_in\tkept\tspins_per_insert\tp50_ns\tp99_ns\tp999_ns\tmax_ns\n"
+
+extern void beam_table_time(beam_table t, const char *label, const char *items, size_t stride, uint64_t n,
+                            int threads);
+extern int beam_replay(const beam_options *opts, const char *path, size_t data_size,
+                       fitness_t fitness(const char *), bool equal(const char *, const char *),
+                       uint64_t hash(const char *));
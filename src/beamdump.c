@@ -0,0 +1,74 @@
+#include "dump.h"
+#include "ternary.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// the drivers that write dumps, by the function that says how to print a
+// dump's records if the driver wrote it
+static beam_dump_print *(*const printers[])(const char *tag) = {
+    ternary_printer_8_8, ternary_printer_16_8, ternary_printer_16_16, ternary_printer_32_8,
+    ternary_printer_32_16, ternary_printer_64_8, ternary_printer_64_16
+};
+#define NPRINTERS (sizeof(printers)/sizeof(printers[0]))
+
+// Prints a dump as text: a header line, then the fitness and hash of each
+// record, the record as the driver that wrote the dump lists it, and with -x
+// its bytes in hex. -f leaves out records below a fitness, -c prints only how
+// many are left.
+int main(int argc, char **argv) {
+    uint32_t minfit = 0;
+    bool hex = false, count = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:xc")) != -1) {
+        switch (opt) {
+        case 'f':
+            minfit = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            hex = true;
+            break;
+        case 'c':
+            count = true;
+            break;
+        default:
+            optind = argc;
+        }
+    }
+    if (optind != argc - 1) {
+        printf("Usage: beamdump [-f <min fitness>] [-x] [-c] <dump>\n");
+        exit(EXIT_FAILURE);
+    }
+    beam_dump *d = beam_dump_open(argv[optind]);
+    if (!d)
+        exit(EXIT_FAILURE);
+    const beam_dump_header *h = d->header;
+    printf("# %s: %lu records of %lu bytes\n", h->tag, h->nitems, h->data_size);
+    beam_dump_print *print = NULL;
+    for (int i = 0; i < NPRINTERS && !print; i++)
+        print = printers[i](h->tag);
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < h->nitems; i++) {
+        if (d->fitness[i] < minfit)
+            continue;
+        n++;
+        if (count)
+            continue;
+        printf("%u %016lx", d->fitness[i], d->hashes[i]);
+        if (print) {
+            printf(" ");
+            print(d->data + h->data_size * i);
+        }
+        if (hex) {
+            const unsigned char *r = (const unsigned char *)d->data + h->data_size * i;
+            printf(" ");
+            for (uint64_t j = 0; j < h->data_size; j++)
+                printf("%02x", r[j]);
+        }
+        printf("\n");
+    }
+    if (count)
+        printf("%lu\n", n);
+    beam_dump_close(d);
+    exit(EXIT_SUCCESS);
+}
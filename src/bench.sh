@@ -0,0 +1,87 @@
+#!/bin/sh
+# Runs each driver on a fixed workload at several thread counts and prints,
+# for each run, the search time, children and inserts per second, peak RSS and
+# speedup over the fewest threads.
+#
+# Usage: bench.sh <examples dir> [<workload>...], from the directory holding
+# the bench_ drivers (make bench does this). THREADS sets the thread counts
+# (by default 1, 2, 4, ... and the number of cores) and BENCH_OUT the file the
+# results also go to as tab separated values (bench.tsv): a line for each
+# generation of each run, then one with generation "all" for the whole run.
+
+ex=${1:?usage: bench.sh <examples dir> [<workload>...]}
+shift
+out=${BENCH_OUT:-bench.tsv}
+
+# the -det workloads are the same searches with deterministic insertion, for
+# what it costs; ternary5-isl splits ternary5's beam between 4 islands, with
+# 64 nodes moving on every 2 generations, for how islands scale
+workloads="ternary3 ternary3-det ternary5 ternary5-isl ternary7 addchain ascode grease gf2 gf4 gf4-det"
+[ $# -gt 0 ] && workloads="$*"
+
+command_for() {
+    case $1 in
+    ternary3) echo "./bench_ternary $ex/code3 $ex/code3 $ex/param3" ;;
+    ternary3-det) echo "./bench_ternary -d $ex/code3 $ex/code3 $ex/param3" ;;
+    ternary5) echo "./bench_ternary $ex/code5b $ex/code5b $ex/param5" ;;
+    ternary5-isl) echo "./bench_ternary -i 4:2:64 $ex/code5b $ex/code5b $ex/param5" ;;
+    ternary7) echo "./bench_ternary $ex/code7 $ex/code7 $ex/param7" ;;
+    addchain) echo "./bench_addchain 1021 14 30000" ;;
+    ascode) echo "./bench_ascode 127 12 10000" ;;
+    grease) echo "./bench_grease 14 10000" ;;
+    gf2) echo "./bench_gf2 30000" ;;
+    gf4) echo "./bench_gf4 50" ;;
+    gf4-det) echo "./bench_gf4 -d 50" ;;
+    *) echo "bench.sh: no workload $1" >&2; exit 1 ;;
+    esac
+}
+
+if [ -z "$THREADS" ]; then
+    cores=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+    t=1
+    while [ $t -lt "$cores" ]; do
+        THREADS="$THREADS $t"
+        t=$((t * 2))
+    done
+    THREADS="$THREADS $cores"
+fi
+
+log=$(mktemp) || exit 1
+trap 'rm -f "$log"' EXIT
+
+printf "workload\tthreads\tgen\tchildren\tinserted\tkept\tseconds\tchildren_per_s\tinserts_per_s\tpeak_rss_kb\n" > "$out"
+printf "%-12s %7s %9s %12s %12s %9s %7s\n" workload threads seconds children/s inserts/s "RSS MB" speedup
+for w in $workloads; do
+    cmd=$(command_for "$w") || exit 1
+    base=
+    for t in $THREADS; do
+        if ! OMP_NUM_THREADS=$t $cmd > "$log" 2>&1; then
+            echo "bench.sh: $w failed with $t threads:" >&2
+            tail -n 5 "$log" >&2
+            exit 1
+        fi
+        line=$(awk -v w="$w" -v t="$t" -v out="$out" '
+            /^Bench: generation/ {
+                gsub(/,/, "")
+                n++
+                gen[n] = $3; ch[n] = $4; ins[n] = $6; kept[n] = $8; sec[n] = $10
+            }
+            /^Bench: peak RSS/ { rss = $4 }
+            function rate(x, s) { return s > 0 ? x / s : 0 }
+            END {
+                for (i = 1; i <= n; i++) {
+                    printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%.0f\t%.0f\t%s\n", w, t, gen[i], ch[i], ins[i],
+                        kept[i], sec[i], rate(ch[i], sec[i]), rate(ins[i], sec[i]), rss >> out
+                    c += ch[i]; s += sec[i]; total += ins[i]
+                }
+                printf "%s\t%s\tall\t%d\t%d\t%s\t%.6f\t%.0f\t%.0f\t%s\n", w, t, c, total, kept[n], s,
+                    rate(c, s), rate(total, s), rss >> out
+                printf "%.6f %.0f %.0f %.1f\n", s, rate(c, s), rate(total, s), rss / 1024
+            }' "$log")
+        set -- $line
+        [ -z "$base" ] && base=$1
+        printf "%-12s %7s %9.3f %12.0f %12.0f %9s %7.2f\n" "$w" "$t" "$1" "$2" "$3" "$4" \
+            "$(awk -v a="$base" -v b="$1" 'BEGIN { print (b > 0 ? a / b : 0) }')"
+    done
+done
+echo "Results in $out"
@@ -0,0 +1,150 @@
+#include "dump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <omp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAGE 4096
+#define PIECE (4 << 20) // bytes per write
+
+static uint64_t round_up(uint64_t x) { return (x + PAGE - 1) & ~(uint64_t)(PAGE - 1); }
+
+// a stretch of memory bound for a place in the file
+typedef struct {
+  const char *from;
+  uint64_t at, len;
+} piece;
+
+static size_t add_pieces(piece *p, const void *from, uint64_t at, uint64_t len) {
+  size_t n = 0;
+  for (uint64_t o = 0; o < len; o += PIECE, n++) {
+    p[n].from = (const char *)from + o;
+    p[n].at = at + o;
+    p[n].len = len - o < PIECE ? len - o : PIECE;
+  }
+  return n;
+}
+
+static int write_all(int fd, const char *from, uint64_t at, uint64_t len) {
+  while (len) {
+    ssize_t w = pwrite(fd, from, len, at);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    from += w;
+    at += w;
+    len -= w;
+  }
+  return 0;
+}
+
+int beam_dump_write(const char *path, const char *tag, const char *items, size_t nitems,
+                    size_t data_size, uint32_t fitness(const char *), uint64_t hash(const char *)) {
+  beam_dump_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BEAM_DUMP_MAGIC, sizeof(h.magic));
+  h.version = BEAM_DUMP_VERSION;
+  h.endian = BEAM_DUMP_ENDIAN;
+  h.data_size = data_size;
+  h.nitems = nitems;
+  h.fitness_offset = PAGE;
+  h.hash_offset = round_up(h.fitness_offset + sizeof(uint32_t) * nitems);
+  h.data_offset = round_up(h.hash_offset + sizeof(uint64_t) * nitems);
+  strncpy(h.tag, tag ? tag : "", sizeof(h.tag) - 1);
+  uint32_t *fit = malloc(sizeof(uint32_t) * (nitems ? nitems : 1));
+  uint64_t *hashes = malloc(sizeof(uint64_t) * (nitems ? nitems : 1));
+  #pragma omp parallel for
+  for (size_t i = 0; i < nitems; i++) {
+    fit[i] = fitness(items + data_size * i);
+    hashes[i] = hash(items + data_size * i);
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  int ok = fd >= 0 && ftruncate(fd, h.data_offset + (uint64_t)data_size * nitems) == 0;
+  if (ok) {
+    uint64_t total = sizeof(h) + sizeof(uint32_t) * nitems + sizeof(uint64_t) * nitems +
+                     (uint64_t)data_size * nitems;
+    piece *pieces = malloc(sizeof(piece) * (total / PIECE + 4));
+    size_t n = add_pieces(pieces, &h, 0, sizeof(h));
+    n += add_pieces(pieces + n, fit, h.fitness_offset, sizeof(uint32_t) * nitems);
+    n += add_pieces(pieces + n, hashes, h.hash_offset, sizeof(uint64_t) * nitems);
+    n += add_pieces(pieces + n, items, h.data_offset, (uint64_t)data_size * nitems);
+    int failed = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(| : failed)
+    for (size_t i = 0; i < n; i++)
+      failed |= write_all(fd, pieces[i].from, pieces[i].at, pieces[i].len) != 0;
+    free(pieces);
+    ok = !failed;
+  }
+  int saved = errno;
+  if (fd >= 0 && close(fd) != 0)
+    ok = 0;
+  free(fit);
+  free(hashes);
+  errno = saved;
+  return ok ? 0 : -1;
+}
+
+// whether the sections lie in order within length bytes, aligned for their
+// columns, with room for nitems entries each; divides rather than multiplies,
+// so that no header, however corrupt, overflows
+static bool sections_fit(const beam_dump_header *h, size_t length) {
+  if (h->fitness_offset < sizeof(beam_dump_header) || h->hash_offset < h->fitness_offset ||
+      h->data_offset < h->hash_offset || h->data_offset > length || h->data_size == 0 ||
+      (h->fitness_offset | h->hash_offset | h->data_offset) % sizeof(uint64_t))
+    return false;
+  return h->nitems <= (h->hash_offset - h->fitness_offset) / sizeof(uint32_t) &&
+         h->nitems <= (h->data_offset - h->hash_offset) / sizeof(uint64_t) &&
+         h->nitems <= (length - h->data_offset) / h->data_size;
+}
+
+beam_dump *beam_dump_open(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  size_t length = st.st_size;
+  const char *map = length >= sizeof(beam_dump_header)
+                        ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: not a dump\n", path);
+    return NULL;
+  }
+  const beam_dump_header *h = (const beam_dump_header *)map;
+  const char *why = NULL;
+  if (memcmp(h->magic, BEAM_DUMP_MAGIC, sizeof(h->magic)))
+    why = "not a dump";
+  else if (h->endian != BEAM_DUMP_ENDIAN)
+    why = "written with the other byte order";
+  else if (h->version != BEAM_DUMP_VERSION)
+    why = "unknown version";
+  else if (!sections_fit(h, length) || memchr(h->tag, 0, sizeof(h->tag)) == NULL)
+    why = "truncated or inconsistent";
+  if (why) {
+    fprintf(stderr, "%s: %s\n", path, why);
+    munmap((void *)map, length);
+    return NULL;
+  }
+  beam_dump *d = malloc(sizeof(beam_dump));
+  d->header = h;
+  d->fitness = (const uint32_t *)(map + h->fitness_offset);
+  d->hashes = (const uint64_t *)(map + h->hash_offset);
+  d->data = map + h->data_offset;
+  d->length = length;
+  return d;
+}
+
+void beam_dump_close(beam_dump *d) {
+  munmap((void *)d->header, d->length);
+  free(d);
+}
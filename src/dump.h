@@ -0,0 +1,67 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Binary dumps of search results, in place of printing them.
+
+A dump is one file, in the byte order of the machine that wrote it:
+
+   offset            contents
+   0                 beam_dump_header (128 bytes), zero padded to 4096
+   fitness_offset    uint32_t fitness of each record, nitems of them
+   hash_offset       uint64_t hash of each record
+   data_offset       the records themselves, data_size bytes each, as the search held them
+
+Each section starts on a 4096 byte boundary and the gaps are zero, so a reader can mmap the file and use
+the columns and records where they lie. endian is BEAM_DUMP_ENDIAN as written; read on a machine of the
+other byte order it comes out different, and beam_dump_open refuses the file. tag says what wrote the dump
+(for ternary, which build, since its records' layout depends on that).
+*/
+
+#define BEAM_DUMP_MAGIC "BEAMDUMP"
+#define BEAM_DUMP_VERSION 1
+#define BEAM_DUMP_ENDIAN 0x01020304
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t data_size;
+    uint64_t nitems;
+    uint64_t fitness_offset;
+    uint64_t hash_offset;
+    uint64_t data_offset;
+    char tag[72];
+} beam_dump_header;
+
+/* Write nitems records, laid out data_size apart from items, to a new dump at path, taking the fitness
+   and hash columns from the functions the search used. The columns are computed and the file written in
+   parallel, in large sequential pieces. Returns 0, or -1 with errno set.
+*/
+extern int beam_dump_write(const char *path, const char *tag, const char *items, size_t nitems,
+                           size_t data_size, uint32_t fitness(const char *), uint64_t hash(const char *));
+
+/* A dump mapped for reading by beam_dump_open, which returns NULL (with a message on stderr) if the
+   file cannot be read or is not a dump. Record i is at data + i*header->data_size.
+*/
+typedef struct {
+    const beam_dump_header *header;
+    const uint32_t *fitness;
+    const uint64_t *hashes;
+    const char *data;
+    size_t length;
+} beam_dump;
+
+extern beam_dump *beam_dump_open(const char *path);
+extern void beam_dump_close(beam_dump *d);
+
+/* Prints a record of a dump as its driver lists it, without a newline. A driver that writes dumps also
+   has a function for beamdump that, given a dump's tag, returns its printer for that dump's records, or
+   NULL if it did not write the dump.
+*/
+typedef void beam_dump_print(const char *record);
+
+#endif
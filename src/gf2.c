@@ -107,10 +107,9 @@ int newline(soln sol, line l) {
 line fix[] = {{1,1},{2,4},{1,2},{2,8},{4,1},{8,4},{4,2},{8,8}};
 
 static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
-    int ct = 0;
     soln c = (soln)parent;
     //print_soln(parent);
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     soln child = (soln)ch;
     int start = 1;
     if (c->len) {
@@ -179,7 +178,7 @@ int main(int argc, char **argv) {
     ((soln)seed)->sumspace.pivs[3] = 9;
     ((soln)seed)->sumspace.dim = 4;
     
-    int nresults;
+    size_t nresults;
     char * results = beam_search(seed,1,visit_children, beamsize, 6,
                                  data_size,  fitness, equal, hash, 3, print_soln, &nresults);
     int maxfitness = 0;
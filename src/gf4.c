@@ -128,18 +128,27 @@ int newline(soln sol, line l) {
     return 3;
 }
 
-static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
-    int ct = 0;
+// Children are indexed by the line they add, a + 256*b; only lines after the
+// last one in the parent are tried.
+
+static uint64_t count_children(const char *parent) {
+    return 1 << 16;
+}
+
+static void visit_children_range(const char *parent, uint64_t lo, uint64_t hi,
+                                 void visit(const char *, void *), void *context) {
     soln c = (soln)parent;
     //print_soln(parent);
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     soln child = (soln)ch;
     int start = 1;
     if (c->len) {
         line ll = c->lines[c->len-1];
         start += ll.a * 256 + ll.b+1;
     }
-    for (int i = start; i < (1<<16); i++)
+    if (lo < start)
+        lo = start;
+    for (int i = lo; i < hi; i++)
         {
             line l;
             l.a = i &0xFF ;
@@ -159,6 +168,10 @@ static void visit_children(const char *parent, void visit(const char *, void *),
         }
 }
 
+static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
+    visit_children_range(parent, 0, count_children(parent), visit, context);
+}
+
 static bool equal(const char *a1, const char *a2) {
     soln s1 = (soln)a1;
     soln s2 = (soln)a2;
@@ -183,6 +196,12 @@ static uint64_t hash( const char *c) {
 int main(int argc, char **argv) {
     int beamsize;
     char * seed = malloc(data_size);
+    // gf4 -d ...: deterministic insertion, see beam.h
+    bool deterministic = argc >= 2 && !strcmp(argv[1], "-d");
+    if (deterministic) {
+        argc--;
+        argv++;
+    }
     beamsize = atoi(argv[1]);
     fill_transtab();
     memset(seed, 0, data_size);
@@ -216,9 +235,22 @@ int main(int argc, char **argv) {
     ((soln)seed)->sum12space.pivs[8] = 44;                                            
     ((soln)seed)->sum12space.dim = 12;
     
-    int nresults;
-    char * results = beam_search(seed,1,visit_children, beamsize, 21,
-                                 data_size,  fitness, equal, hash, 3, print_soln, &nresults);
+    size_t nresults;
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.count_children = count_children;
+    opts.visit_children_range = visit_children_range;
+    opts.deterministic = deterministic;
+    // gf4 <beamsize> <capture> <generation>: capture that generation's
+    // children; gf4 -r <capture>: time inserting them, see beam_replay
+    if (argc >= 4) {
+        opts.capture = argv[2];
+        opts.capture_gen = atoi(argv[3]);
+    }
+    if (argc >= 3 && !strcmp(argv[1], "-r"))
+        exit(beam_replay(&opts, argv[2], data_size, fitness, equal, hash) ? EXIT_FAILURE : EXIT_SUCCESS);
+    char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, 21,
+                                      data_size,  fitness, equal, hash, 3, print_soln, &nresults);
     int maxfitness = 0;
     const char * bestsoln = NULL;
     int count = 0;
@@ -20,10 +20,9 @@ static uint32_t fitness(const char *cv) {
 }
 
 static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
-    int ct = 0;
     code c = (code)parent;
     int l = c->len;
-    char ch[data_size];
+    char *ch = beam_scratch(context, data_size);
     code child = (code)ch;
     elt x;
     for (x = 0; x < (1 << NB); x++) {
@@ -57,6 +56,29 @@ static uint64_t hash( const char *c) {
     return h;    
 }
 
+#ifdef HASHID
+// a second hash of the code, which with hash identifies it: records are
+// large, so duplicates are found without comparing them
+static uint64_t identity_hash(const char *c) {
+    const code cc = (code)c;
+    uint64_t h = cc->len;
+    for (int i = 0; i < cc->len; i++) {
+        h = (h ^ cc->code[i]) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+#endif
+
+// each element added to a code of length l makes at most l new sums
+static uint32_t bound(const char *cv, int gens) {
+    code c = (code)cv;
+    uint64_t b = c->fitness;
+    for (int l = c->len; l < c->len + gens && b < (1 << NB); l++)
+        b += l;
+    return b < (1 << NB) ? b : (1 << NB);
+}
+
 static void print_code(const char *i) {
     const code c = (code) i;
     printf("<code");
@@ -86,9 +108,15 @@ int main(int argc, char **argv) {
         for (int j = 0; j < i; j++)
             ((code)seed)->mask[(1 << i) | (1 << j)] = 1;
     }
-    int nresults;
-    char * results = beam_search(seed,1,visit_children, beamsize, len-NB-1,
-                                 data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
+    size_t nresults;
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.bound = bound;
+#ifdef HASHID
+    opts.identity_hash = identity_hash;
+#endif
+    char * results = beam_search_opts(&opts, seed,1,visit_children, beamsize, len-NB-1,
+                                      data_size,  fitness, equal, hash, nprobes, print_code, &nresults);
     int maxfitness = 0;
     const char * bestcode = NULL;
     int *fitcounts = calloc(sizeof(int),(1<<NB)+1);
@@ -0,0 +1,176 @@
+#include "beam.h"
+#include <omp.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Insertion into the beam table on synthetic items, apart from any driver. (To replay what a driver
+offered in a real search, with its own equal and options, see beam_replay.)
+
+Each record holds its hash and fitness, and up to the record size more bytes, which follow from which
+item it is; equal compares all of it. Insert g (of n, shared out between the threads) repeats the item
+of an earlier insert with the duplicate rate as probability, and is otherwise a new item; n is chosen so that the new items number the load factor times the table size.
+The fitness of an item is 1000 for all (-f flat), uniform in 1..1000 (uniform) or mostly low (skew).
+
+The records are made before the clock starts. For each engine and thread count it prints the line of
+beam_table_time: inserts per second, the share that went in, items held at the end, spins (CAS retries
+and waits for a slot or bucket held by another thread) per insert, and latencies of a sample of inserts.
+*/
+
+typedef struct {
+    uint64_t hash;
+    fitness_t fitness;
+    uint32_t pad;
+} record;
+
+static size_t record_size = 64;
+static int fitness_mode; // 0 flat, 1 uniform, 2 skew
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+static fitness_t fitness(const char *item) {
+    return ((const record *)item)->fitness;
+}
+
+static bool equal(const char *a, const char *b) {
+    return !memcmp(a, b, record_size);
+}
+
+static uint64_t hash(const char *item) {
+    return ((const record *)item)->hash;
+}
+
+// The engines to measure: each makes a table from the options it is given.
+// Another insertion engine is another entry.
+typedef struct {
+    const char *name;
+    void (*setup)(beam_options *);
+} engine;
+
+static void probe_engine(beam_options *opts) {
+}
+
+static void bucket_engine(beam_options *opts) {
+    opts->deterministic = true;
+}
+
+static const engine engines[] = {{"probe", probe_engine}, {"bucket", bucket_engine}};
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+// the item of insert g: an earlier one's with probability dup, else its own
+static uint64_t item_of(uint64_t g, double dup) {
+    while (g > 0) {
+        uint64_t r = mix(g);
+        if ((r >> 11) * 0x1.0p-53 >= dup)
+            break;
+        g = mix(r) % g;
+    }
+    return g;
+}
+
+static void make_record(char *at, uint64_t id) {
+    record *r = (record *)at;
+    memset(r, 0, sizeof(record));
+    r->hash = mix(id ^ 0x5555555555555555);
+    uint64_t m = mix(id);
+    double x = (m >> 11) * 0x1.0p-53;
+    if (fitness_mode == 0)
+        r->fitness = 1000;
+    else if (fitness_mode == 1)
+        r->fitness = 1 + m % 1000;
+    else
+        r->fitness = 1 + (fitness_t)(999 * x * x * x * x);
+    for (size_t i = sizeof(record); i < record_size; i++)
+        at[i] = (char)(m >> (8 * (i % 8)));
+}
+
+static void run(const engine *e, int threads, size_t tabsize, int nprobes, const char *records,
+                uint64_t n) {
+    beam_options opts;
+    beam_default_options(&opts);
+    e->setup(&opts);
+    beam_table t = beam_table_new(&opts, record_size, tabsize, fitness, equal, hash, nprobes);
+    beam_table_time(t, e->name, records, record_size, n, threads);
+    beam_table_free(t);
+}
+
+int main(int argc, char **argv) {
+    size_t tabsize = 1 << 20;
+    int nprobes = 3;
+    double dup = 0.1, load = 2;
+    const char *engine_name = NULL;
+    char *thread_list = NULL;
+    bool bad = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:l:u:s:f:e:t:")) != -1) {
+        switch (opt) {
+        case 'n':
+            tabsize = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            nprobes = atoi(optarg);
+            break;
+        case 'l':
+            load = atof(optarg);
+            break;
+        case 'u':
+            dup = atof(optarg);
+            break;
+        case 's':
+            record_size = (strtoul(optarg, NULL, 10) + 7) & ~(size_t)7; // keeping records aligned
+            break;
+        case 'f':
+            fitness_mode = !strcmp(optarg, "flat") ? 0 : !strcmp(optarg, "uniform") ? 1
+                           : !strcmp(optarg, "skew") ? 2 : -1;
+            break;
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 't':
+            thread_list = optarg;
+            break;
+        default:
+            bad = true;
+        }
+    }
+    bool known = !engine_name;
+    for (size_t e = 0; e < NENGINES; e++)
+        known |= engine_name && !strcmp(engine_name, engines[e].name);
+    if (bad || optind != argc || !known || fitness_mode < 0 || record_size < sizeof(record) || nprobes < 1 ||
+        dup < 0 || dup >= 1 || load <= 0) {
+        printf("Usage: tablebench [-n <slots>] [-p <probes>] [-l <load factor>] [-u <duplicate rate>]\n"
+               "                  [-s <record bytes>] [-f flat|uniform|skew] [-e probe|bucket]\n"
+               "                  [-t <threads>,...]\n");
+        exit(EXIT_FAILURE);
+    }
+    int threads[64], nthreads = 0;
+    if (thread_list) {
+        for (char *s = strtok(thread_list, ","); s && nthreads < 64; s = strtok(NULL, ","))
+            threads[nthreads++] = atoi(s);
+    } else {
+        int cores = omp_get_num_procs();
+        for (int k = 1; k < cores; k *= 2)
+            threads[nthreads++] = k;
+        threads[nthreads++] = cores;
+    }
+    uint64_t n = load * tabsize / (1 - dup);
+    printf("# %lu slots, %i probes, %lu inserts, load factor %g, duplicate rate %g, %lu byte records\n",
+           tabsize, nprobes, n, load, dup, record_size);
+    char *records = malloc(record_size * n);
+    #pragma omp parallel for
+    for (uint64_t g = 0; g < n; g++)
+        make_record(records + record_size * g, item_of(g, dup));
+    printf(BEAM_TABLE_COLUMNS);
+    for (size_t e = 0; e < NENGINES; e++) {
+        if (engine_name && strcmp(engine_name, engines[e].name))
+            continue;
+        for (int k = 0; k < nthreads; k++)
+            run(engines + e, threads[k], tabsize, nprobes, records, n);
+    }
+    free(records);
+    exit(EXIT_SUCCESS);
+}
@@ -1,4 +1,6 @@
 #include "beam.h"
+#include "ternary.h"
+#include "dump.h"
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
@@ -6,11 +8,29 @@
 #define MAXMOVE 16
 #define ANDN 1
 
-typedef uint16_t regs_t;
-typedef uint16_t res_t;
-typedef uint8_t nstates_t;
-#define NREGS 8*sizeof(regs_t)
-#define MAXSTATES (1<<(8*sizeof(nstates_t)))
+// Widths of a state. Built once per width by the Makefile, with
+// ternary_main.c choosing at run time; built alone this is an ordinary
+// program with 16 bit registers and at most 255 states.
+#ifndef REGBITS
+#define REGBITS 16
+#endif
+#ifndef STATEBITS
+#define STATEBITS 8
+#endif
+
+#define UINT_(n) uint##n##_t
+#define UINT(n) UINT_(n)
+typedef UINT(REGBITS) regs_t;
+typedef UINT(REGBITS) res_t; // residues mod P, so P <= 256 with 8 bit registers
+typedef UINT(STATEBITS) nstates_t;
+#define NREGS (8*sizeof(regs_t))
+// 16 bit state counts are limited by the per-parent bit-sliced view
+// rather than by nstates_t
+#if STATEBITS == 8
+#define MAXSTATES 256
+#else
+#define MAXSTATES 4096
+#endif
 #define FAIL (MAXSTATES -1)
 
 
@@ -21,6 +41,9 @@ typedef struct {
     uint8_t r3;
     uint8_t op;
     uint8_t drop;
+#if defined(CANON) && defined(TRACKMOVES)
+    uint8_t relabel[NREGS]; // register i afterwards was register relabel[i] before
+#endif
 } move;
 
 typedef struct {
@@ -31,6 +54,7 @@ typedef struct {
 typedef struct s_node {
     nstates_t s; // number of states
     uint8_t r; // number of registers
+    uint32_t ham; // hamming score of the states, kept up to date when valh is set
 #ifdef TRACKMOVES
     uint8_t nmoves; // number of moves to get here
     move moves[MAXMOVE]; // record of those moves
@@ -41,6 +65,7 @@ typedef struct s_node {
 typedef struct {
     uint8_t len;
     nstates_t size;
+    bool toowide; // needs more registers, states or residues than this build has
     state codewords[];
 } coding;
 
@@ -50,56 +75,87 @@ static fitness_t valreg, valstate, valh;
 
 
 
-uint8_t ternary(uint8_t op, uint8_t in1, uint8_t in2, uint8_t in3) {
+static inline uint8_t ternary(uint8_t op, uint8_t in1, uint8_t in2, uint8_t in3) {
     return (op >>  (in1 | in2 | in3)) & 1;
 }
 
-uint8_t binary(uint8_t op, uint8_t in1, uint8_t in2) {
+static inline uint8_t binary(uint8_t op, uint8_t in1, uint8_t in2) {
     return (op >> (in1 | in2)) &1;
 }
 
-const static regs_t mask1[16] = {
-                                   32767, 16383, 8191, 4095, 
-                                   2047, 1023, 511, 255, 
-                                   127, 63, 31, 15, 
-                                   7, 3, 1, 0, 
-};
-const static regs_t mask2[17] = {
-                                   0, 32768, 49152, 57344, 
-                                   61440, 63488, 64512, 65024, 
-                                   65280, 65408, 65472, 65504, 
-                                   65520, 65528, 65532, 65534, 65535
-};
+// mask1[i] has the registers after i, mask2[i] those before it
+static regs_t mask1[NREGS], mask2[NREGS];
+
+static void build_masks(void) {
+    regs_t all = ~(regs_t)0;
+    for (int i = 0; i < NREGS; i++) {
+        mask1[i] = i+1 < NREGS ? (regs_t)(all >> (i+1)) : 0;
+        mask2[i] = i ? (regs_t)(all << (NREGS-i)) : 0;
+    }
+}
 
-void drop(state *st, uint8_t pos) {
-    regs_t l = st->regs & mask1[pos];
-    regs_t r = st->regs & mask2[pos];
-    st->regs = r | (l << 1);
+static inline regs_t drop_reg(regs_t x, uint8_t pos) {
+    return (x & mask2[pos]) | ((x & mask1[pos]) << 1);
 }
 
-uint8_t reg_extract_topos(regs_t r, uint8_t pos, uint8_t to) {
+static inline void drop(state *st, uint8_t pos) {
+    st->regs = drop_reg(st->regs, pos);
+}
+
+static inline uint8_t reg_extract_topos(regs_t r, uint8_t pos, uint8_t to) {
     return ((r << pos)>> (NREGS-1-to)) & (1 << to);
 }
 
-uint8_t reg_extract(regs_t r, uint8_t pos) {
+static inline uint8_t reg_extract(regs_t r, uint8_t pos) {
     return reg_extract_topos(r,pos,0);
 }
 
-void reg_set(regs_t *r, uint8_t pos, uint8_t val) {
-    *r |= ((val << (NREGS-1)) >> pos);
+static inline void reg_set(regs_t *r, uint8_t pos, uint8_t val) {
+    *r |= (((regs_t)val << (NREGS-1)) >> pos);
 }
 
 
-uint64_t hamming_states(node *n) {
-    uint64_t score = 0;
-    for (int i = 0; i < n->s-1; i++) {
+// number states by their result: grp[i] is the group of state i, groups
+// numbered in order of first appearance. Returns the number of groups.
+static int res_groups(const node *n, nstates_t *grp) {
+    res_t keys[2*MAXSTATES];
+    int16_t ids[2*MAXSTATES];
+    int size = 16;
+    while (size < 2*n->s)
+        size *= 2;
+    memset(ids, -1, sizeof(int16_t)*size);
+    int ngroups = 0;
+    for (int i = 0; i < n->s; i++) {
         res_t r = n->states[i].res;
-        regs_t rg = n->states[i].regs;
-        for (int j = i+1; j < n->s; j++) {
-            if (n->states[j].res == r) {
-                score += __builtin_popcount(rg ^ n->states[j].regs);
-            }
+        unsigned h = (r * 2654435761u) & (size-1);
+        while (ids[h] >= 0 && keys[h] != r)
+            h = (h+1) & (size-1);
+        if (ids[h] < 0) {
+            keys[h] = r;
+            ids[h] = ngroups++;
         }
+        grp[i] = ids[h];
+    }
+    return ngroups;
+}
+
+// sum over pairs of states with the same result of the hamming distance
+// between their registers. Within a group each register contributes
+// ones*zeros, so this is linear in the number of states.
+static uint32_t hamming_states(const node *n) {
+    nstates_t grp[MAXSTATES];
+    int ngroups = res_groups(n, grp);
+    uint16_t sizes[MAXSTATES], ones[MAXSTATES];
+    memset(sizes, 0, sizeof(uint16_t)*ngroups);
+    for (int i = 0; i < n->s; i++)
+        sizes[grp[i]]++;
+    uint32_t score = 0;
+    for (int j = 0; j < n->r; j++) {
+        memset(ones, 0, sizeof(uint16_t)*ngroups);
+        for (int i = 0; i < n->s; i++)
+            ones[grp[i]] += reg_extract(n->states[i].regs, j);
+        for (int g = 0; g < ngroups; g++)
+            score += ones[g] * (sizes[g] - ones[g]);
     }
     return score;
 }
@@ -109,11 +165,12 @@ static uint32_t fitness(const char *cv) {
     node *n = (node *)cv;
     fitness_t f =  1000000 - valstate*n->s - valreg*n->r;
     if (valh)
-        f -= valh*hamming_states(n);
+        f -= valh*n->ham;
     return f;
 }
 
-void apply1(state *st, const move *m, uint8_t nextreg) {
+#if defined(BINARY) || defined(ARM)
+static void apply1(state *st, const move *m, uint8_t nextreg) {
     uint8_t in1, in2, in3;
     switch(m->arity) {
     case 1:
@@ -151,11 +208,12 @@ void apply1(state *st, const move *m, uint8_t nextreg) {
 
 const static uint8_t del2[4] = {1,0,0,-1};
 const static uint8_t del3[8] = {1,0,0,-1,0,-1,-1,-2};
+#endif
 
 
 
 // returns number of states remaining, or FAIL
-nstates_t sort_and_merge_states (state *states, nstates_t nstates) {
+static nstates_t sort_and_merge_states (state *states, nstates_t nstates) {
     if (nstates == 0)
         return 0;    
     nstates_t newstates = 1;
@@ -190,7 +248,8 @@ nstates_t sort_and_merge_states (state *states, nstates_t nstates) {
     return newstates;
 }
 
-
+// binary and ternary moves are evaluated bit-sliced, see apply8
+#if defined(BINARY) || defined(ARM)
 static bool apply(node *c, const move *m) {
     if (c->r >= NREGS) {
         printf("Register overflow\n");
@@ -215,78 +274,592 @@ static bool apply(node *c, const move *m) {
         if (c->s == FAIL)
             return false;
     }
+    if (valh)
+        c->ham = hamming_states(c);
 #ifdef TRACKMOVES
     // record the move
     c->moves[c->nmoves++] = *m;
 #endif
     return true;
 }
+#endif
 
 
-static inline node *ind(node *arr, int i) {
-    return (node *)(((char *)arr)+i*data_size);
+// Bit-sliced view of a node, built once per parent. cols[i] holds register i
+// of every state, one bit per state, so a move computes its new register for
+// all states at once from the minterms of its inputs. twins[i] lists the
+// pairs of states with different results that differ only in register i:
+// dropping i is a contradiction exactly when the new register fails to
+// separate one of these pairs.
+
+#define NWORDS ((MAXSTATES+63)/64)
+typedef uint64_t column[NWORDS];
+
+typedef struct {
+    nstates_t a, b;
+} twin;
+
+typedef struct {
+    int nwords;
+    column cols[NREGS];
+    int ntwins[NREGS];
+    twin twins[NREGS][MAXSTATES/2];
+    // states grouped by result, for the hamming score
+    nstates_t nstates;
+    int ngroups;
+    uint16_t gsize[MAXSTATES];
+    column gmask[MAXSTATES];
+    uint32_t contrib[NREGS];
+} sliced;
+
+static inline int colbit(const uint64_t *c, int s) {
+    return (c[s >> 6] >> (s & 63)) & 1;
 }
 
-static inline uint8_t makefrom(node *o, int i, int j, int d) {
-    node *n = ind(o,i);
-    memcpy(n,ind(o,j),data_size);
-    state *ss = n->states;
-    nstates_t ns = n->s;
-    for (int i = 0; i < ns; i++) {
-        drop(ss+i, d);
+static int find_state(const node *n, int lo, regs_t x) {
+    int hi = n->s - 1;
+    while (hi >= lo) {
+        int mid = (lo + hi)/2;
+        regs_t y = n->states[mid].regs;
+        if (x == y)
+            return mid;
+        if (x > y)
+            lo = mid+1;
+        else
+            hi = mid-1;
     }
-    n->r--;
-    nstates_t x = sort_and_merge_states(ss, ns);
-    if (x != FAIL) {
-        n->s = x;
+    return -1;
+}
+
+// contribution of a column of the sliced node to its hamming score
+static uint32_t column_hamming(const sliced *sl, const uint64_t *c) {
+    uint32_t score = 0;
+    for (int g = 0; g < sl->ngroups; g++) {
+        int ones = 0;
+        for (int w = 0; w < sl->nwords; w++)
+            ones += __builtin_popcountll(c[w] & sl->gmask[g][w]);
+        score += ones * (sl->gsize[g] - ones);
+    }
+    return score;
+}
+
+static void slice(const node *n, sliced *sl) {
+    sl->nwords = (n->s + 63)/64;
+    memset(sl->cols, 0, sizeof(column)*n->r);
+    for (int s = 0; s < n->s; s++) {
+        regs_t x = n->states[s].regs;
+        for (int i = 0; i < n->r; i++)
+            if (reg_extract(x, i))
+                sl->cols[i][s >> 6] |= (uint64_t)1 << (s & 63);
+    }
+    for (int i = 0; i < n->r; i++) {
+        regs_t bit = ((regs_t)1 << (NREGS-1)) >> i;
+        int nt = 0;
+        for (int a = 0; a < n->s; a++) {
+            regs_t x = n->states[a].regs;
+            if (x & bit)
+                continue;
+            int b = find_state(n, a+1, x | bit);
+            if (b >= 0 && n->states[a].res != n->states[b].res) {
+                sl->twins[i][nt].a = a;
+                sl->twins[i][nt].b = b;
+                nt++;
+            }
+        }
+        sl->ntwins[i] = nt;
+    }
+    sl->nstates = n->s;
+    if (valh) {
+        nstates_t grp[MAXSTATES];
+        sl->ngroups = res_groups(n, grp);
+        memset(sl->gmask, 0, sizeof(column)*sl->ngroups);
+        memset(sl->gsize, 0, sizeof(uint16_t)*sl->ngroups);
+        for (int s = 0; s < n->s; s++) {
+            sl->gmask[grp[s]][s >> 6] |= (uint64_t)1 << (s & 63);
+            sl->gsize[grp[s]]++;
+        }
+        for (int i = 0; i < n->r; i++)
+            sl->contrib[i] = column_hamming(sl, sl->cols[i]);
+    }
+}
+
+// minterm t of the inputs has input 1 in bit nin-1 of t, as in ternary() and binary()
+static void minterms(const sliced *sl, int nin, const uint8_t *ins, column *mt) {
+    for (int t = 0; t < (1 << nin); t++)
+        for (int w = 0; w < sl->nwords; w++) {
+            uint64_t x = ~(uint64_t)0;
+            for (int k = 0; k < nin; k++) {
+                uint64_t c = sl->cols[ins[k]][w];
+                x &= ((t >> (nin-1-k)) & 1) ? c : ~c;
+            }
+            mt[t][w] = x;
+        }
+}
+
+// The move table, built at startup from TernaryOps and BinaryOps. Moves are
+// only generated on registers i < j < k, so one entry covers every input
+// permutation of an op: build_moves drops repeated functions and ops that
+// ignore an input (those are lower arity moves), and lists the minterms on
+// which each op is 1.
+
+typedef struct {
+    uint8_t op;
+    uint8_t nmt;
+    uint8_t mt[8];
+} opinfo;
+
+static opinfo ternmoves[256], binmoves[16];
+static int nternmoves, nbinmoves;
+
+static bool degenerate_op(uint8_t op, int nin) {
+    for (int k = 0; k < nin; k++) {
+        bool ignored = true;
+        for (int t = 0; t < (1 << nin); t++)
+            ignored &= ((op >> t) & 1) == ((op >> (t ^ (1 << k))) & 1);
+        if (ignored)
+            return true;
+    }
+    return false;
+}
+
+static int add_moves(const uint8_t *ops, int nops, int nin, opinfo *tab, int *dropped) {
+    int n = 0;
+    for (int i = 0; i < nops; i++) {
+        uint8_t op = ops[i];
+        bool seen = false;
+        for (int j = 0; j < n; j++)
+            seen |= tab[j].op == op;
+        if (seen || degenerate_op(op, nin)) {
+            (*dropped)++;
+            continue;
+        }
+        opinfo *oi = tab + n++;
+        oi->op = op;
+        oi->nmt = 0;
+        for (int t = 0; t < (1 << nin); t++)
+            if ((op >> t) & 1)
+                oi->mt[oi->nmt++] = t;
+    }
+    return n;
+}
+
+static void new_column(const sliced *sl, const column *mt, const opinfo *oi, uint64_t *nc) {
+    for (int w = 0; w < sl->nwords; w++) {
+        uint64_t x = 0;
+        for (int t = 0; t < oi->nmt; t++)
+            x |= mt[oi->mt[t]][w];
+        nc[w] = x;
+    }
+}
+
+static bool drop_ok(const sliced *sl, int d, const uint64_t *nc) {
+    const twin *tw = sl->twins[d];
+    for (int t = 0; t < sl->ntwins[d]; t++)
+        if (colbit(nc, tw[t].a) == colbit(nc, tw[t].b))
+            return false;
+    return true;
+}
+
+// the move m with no drops, its new register given by nc
+static void add_column(const node *c, const sliced *sl, const move *m,
+                       const uint64_t *nc, node *o) {
+    memcpy(o,c,data_size);
+    regs_t bit = ((regs_t)1 << (NREGS-1)) >> c->r;
+    for (int w = 0; w*64 < c->s; w++) {
+        uint64_t x = nc[w];
+        if (c->s - w*64 < 64)
+            x &= ((uint64_t)1 << (c->s - w*64)) - 1;
+        while (x) {
+            o->states[w*64 + __builtin_ctzll(x)].regs |= bit;
+            x &= x-1;
+        }
+    }
+    o->r++;
+    if (valh)
+        o->ham += column_hamming(sl, nc);
 #ifdef TRACKMOVES
-        n->moves[n->nmoves-1].drop = i;
+    o->moves[o->nmoves++] = *m;
+#endif
+}
+
+#ifdef CANON
+
+// Canonical register order. Nodes that differ only by a relabelling of
+// registers are the same partial circuit, so before a child is visited its
+// registers are put in an order that depends only on its state set:
+// columns are sorted by an invariant (the number of ones in each result
+// group, refined by the overlaps with the other columns), and columns the
+// invariant cannot tell apart are tried in every order, keeping the
+// smallest state list, when there are at most CANON_TRIES orders.
+// Otherwise they keep their existing order, which is still a valid
+// relabelling, just not always the canonical one.
+
+#ifndef CANON_TRIES
+#define CANON_TRIES 6
 #endif
-        return 1 << i;
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 31);
+}
+
+// per-thread buffer for sort_states
+static __thread state *merge_scratch;
+
+// sort states by regs, no merging needed; byte-wise LSD radix sort except
+// for short lists
+static void sort_states(state *states, nstates_t nstates) {
+    if (nstates >= 64) {
+        if (!merge_scratch)
+            merge_scratch = malloc(sizeof(state)*MAXSTATES);
+        state *src = states, *dst = merge_scratch;
+        for (int b = 0; b < sizeof(regs_t); b++) {
+            uint32_t c[256];
+            memset(c, 0, sizeof(c));
+            for (int i = 0; i < nstates; i++)
+                c[(src[i].regs >> (8*b)) & 0xFF]++;
+            uint32_t tot = 0;
+            for (int d = 0; d < 256; d++) {
+                uint32_t t = c[d];
+                c[d] = tot;
+                tot += t;
+            }
+            for (int i = 0; i < nstates; i++)
+                dst[c[(src[i].regs >> (8*b)) & 0xFF]++] = src[i];
+            state *t = src;
+            src = dst;
+            dst = t;
+        }
+        if (src != states)
+            memcpy(states, src, sizeof(state)*nstates);
+        return;
+    }
+    for (int i = 1; i < nstates; i++) {
+        state s = states[i];
+        int j = i-1;
+        while (j >= 0 && states[j].regs > s.regs) {
+            states[j+1] = states[j];
+            j--;
+        }
+        states[j+1] = s;
+    }
+}
+
+static void relabel(const state *from, state *to, nstates_t ns, int r, const uint8_t *order) {
+    for (int s = 0; s < ns; s++) {
+        regs_t x = from[s].regs, y = 0;
+        for (int p = 0; p < r; p++)
+            reg_set(&y, p, reg_extract(x, order[p]));
+        to[s].regs = y;
+        to[s].res = from[s].res;
+    }
+    sort_states(to, ns);
+}
+
+static int cmp_states(const state *a, const state *b, nstates_t ns) {
+    for (int s = 0; s < ns; s++) {
+        if (a[s].regs != b[s].regs)
+            return a[s].regs < b[s].regs ? -1 : 1;
+        if (a[s].res != b[s].res)
+            return a[s].res < b[s].res ? -1 : 1;
     }
     return 0;
 }
 
+static bool next_perm(uint8_t *a, int n) {
+    int i = n-2;
+    while (i >= 0 && a[i] >= a[i+1])
+        i--;
+    if (i < 0) {
+        // wrap round to sorted order
+        for (int l = 0, h = n-1; l < h; l++, h--) {
+            uint8_t t = a[l]; a[l] = a[h]; a[h] = t;
+        }
+        return false;
+    }
+    int j = n-1;
+    while (a[j] <= a[i])
+        j--;
+    uint8_t t = a[i]; a[i] = a[j]; a[j] = t;
+    for (int l = i+1, h = n-1; l < h; l++, h--) {
+        t = a[l]; a[l] = a[h]; a[h] = t;
+    }
+    return true;
+}
+
+static void canonicalize(node *n) {
+    int r = n->r;
+    column cols[NREGS];
+    memset(cols, 0, sizeof(column)*r);
+    nstates_t grp[MAXSTATES];
+    int ngroups = res_groups(n, grp);
+    uint16_t ones[ngroups][NREGS];
+    res_t gres[ngroups];
+    memset(ones, 0, sizeof(ones));
+    for (int s = 0; s < n->s; s++) {
+        regs_t x = n->states[s].regs;
+        gres[grp[s]] = n->states[s].res;
+        for (int i = 0; i < r; i++)
+            if (reg_extract(x, i)) {
+                cols[i][s >> 6] |= (uint64_t)1 << (s & 63);
+                ones[grp[s]][i]++;
+            }
+    }
+    int nwords = (n->s + 63)/64;
+    uint64_t h1[NREGS], h2[NREGS];
+    for (int i = 0; i < r; i++) {
+        uint64_t h = 0;
+        for (int g = 0; g < ngroups; g++)
+            h += mix(gres[g], ones[g][i]);
+        h1[i] = h;
+        h2[i] = mix(h, 0);
+    }
+    for (int i = 0; i < r; i++)
+        for (int j = i+1; j < r; j++) {
+            int both = 0;
+            for (int w = 0; w < nwords; w++)
+                both += __builtin_popcountll(cols[i][w] & cols[j][w]);
+            h2[i] += mix(h1[j], both);
+            h2[j] += mix(h1[i], both);
+        }
+    uint8_t order[NREGS] = {0};
+    for (int p = 0; p < r; p++) {
+        int j = p-1;
+        while (j >= 0 && h2[order[j]] > h2[p]) {
+            order[j+1] = order[j];
+            j--;
+        }
+        order[j+1] = p;
+    }
+    // runs of columns with equal invariants, and how many orders they allow
+    int runstart[NREGS], nruns = 0, tries = 1;
+    for (int p = 0; p < r; p++) {
+        if (p == 0 || h2[order[p]] != h2[order[p-1]])
+            runstart[nruns++] = p;
+        else if (tries <= CANON_TRIES)
+            tries *= p - runstart[nruns-1] + 1;
+    }
+    runstart[nruns] = r;
+    if (nruns == r) {
+        // no ties, so nothing to search; often nothing to do at all
+        bool same = true;
+        for (int p = 0; p < r; p++)
+            same &= order[p] == p;
+        if (same) {
+#ifdef TRACKMOVES
+            if (n->nmoves)
+                memset(n->moves[n->nmoves-1].relabel, 0xFF, NREGS);
+#endif
+            return;
+        }
+    }
+    uint8_t best[NREGS];
+    memcpy(best, order, r);
+    state cur[n->s], bestst[n->s];
+    relabel(n->states, bestst, n->s, r, order);
+    if (tries > 1 && tries <= CANON_TRIES) {
+        // odometer over the orders of each run
+        while (1) {
+            int k = 0;
+            while (k < nruns && !next_perm(order + runstart[k], runstart[k+1]-runstart[k]))
+                k++;
+            if (k == nruns)
+                break;
+            relabel(n->states, cur, n->s, r, order);
+            if (cmp_states(cur, bestst, n->s) < 0) {
+                memcpy(bestst, cur, sizeof(state)*n->s);
+                memcpy(best, order, r);
+            }
+        }
+    }
+    memcpy(n->states, bestst, sizeof(state)*n->s);
+#ifdef TRACKMOVES
+    if (n->nmoves) {
+        memset(n->moves[n->nmoves-1].relabel, 0xFF, NREGS);
+        memcpy(n->moves[n->nmoves-1].relabel, best, r);
+    }
+#endif
+}
+
+#endif
+
+// The parent's states with the registers in D removed, sorted and grouped
+// by what is left. Built once per register pair or triple and shared by
+// every op: a child dropping D has one state per group and value of the new
+// register, so it is read straight off the layout.
+
+typedef struct {
+    bool built; // layouts are built on first use
+    nstates_t n;
+    regs_t key[MAXSTATES];
+    nstates_t idx[MAXSTATES];
+} layout;
+
+// ins are the inputs of the move, bit k of D says whether ins[k] is dropped
+static void build_layout(const node *c, const uint8_t *ins, int nin, int D,
+                         layout *L, layout *tmp) {
+    L->built = true;
+    L->n = c->s;
+    for (int s = 0; s < c->s; s++) {
+        regs_t x = c->states[s].regs;
+        // drop from the right so the earlier positions stay put
+        for (int k = nin-1; k >= 0; k--)
+            if ((D >> k) & 1)
+                x = drop_reg(x, ins[k]);
+        L->key[s] = x;
+        L->idx[s] = s;
+    }
+    if (c->s < 64) {
+        for (int i = 1; i < c->s; i++) {
+            regs_t k = L->key[i];
+            nstates_t x = L->idx[i];
+            int j = i-1;
+            while (j >= 0 && L->key[j] > k) {
+                L->key[j+1] = L->key[j];
+                L->idx[j+1] = L->idx[j];
+                j--;
+            }
+            L->key[j+1] = k;
+            L->idx[j+1] = x;
+        }
+        return;
+    }
+    layout *src = L, *dst = tmp;
+    for (int b = 0; b < sizeof(regs_t); b++) {
+        uint32_t cnt[256];
+        memset(cnt, 0, sizeof(cnt));
+        for (int i = 0; i < c->s; i++)
+            cnt[(src->key[i] >> (8*b)) & 0xFF]++;
+        uint32_t tot = 0;
+        for (int d = 0; d < 256; d++) {
+            uint32_t t = cnt[d];
+            cnt[d] = tot;
+            tot += t;
+        }
+        for (int i = 0; i < c->s; i++) {
+            uint32_t at = cnt[(src->key[i] >> (8*b)) & 0xFF]++;
+            dst->key[at] = src->key[i];
+            dst->idx[at] = src->idx[i];
+        }
+        layout *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != L) {
+        memcpy(L->key, src->key, sizeof(regs_t)*c->s);
+        memcpy(L->idx, src->idx, sizeof(nstates_t)*c->s);
+    }
+}
+
+// the move m dropping D, its new register given by nc. Returns 1 << D,
+// or 0 if two states with different results collide. lay is indexed by D,
+// with lay[8] as sorting space.
+static uint8_t dropfrom(const node *c, const sliced *sl, layout *lay, int D,
+                        const uint8_t *ins, int nin, const uint64_t *nc,
+                        const move *m, node *o) {
+    layout *L = lay + D;
+    if (!L->built)
+        build_layout(c, ins, nin, D, L, lay+8);
+    int ndrop = __builtin_popcount(D);
+    regs_t bit = ((regs_t)1 << (NREGS-1)) >> (c->r - ndrop);
+    nstates_t ns = 0;
+    int p = 0;
+    // every byte of a child counts in deterministic mode, so none is left as
+    // the scratch had it: not the padding in states, nor those past the last
+    memset(o->states, 0, data_size - sizeof(node));
+    while (p < L->n) {
+        regs_t k = L->key[p];
+        bool has[2] = {false, false};
+        res_t res[2];
+        do {
+            nstates_t st = L->idx[p];
+            int b = colbit(nc, st);
+            res_t r = c->states[st].res;
+            if (has[b] && res[b] != r)
+                return 0;
+            has[b] = true;
+            res[b] = r;
+            p++;
+        } while (p < L->n && L->key[p] == k);
+        for (int b = 0; b < 2; b++)
+            if (has[b]) {
+                o->states[ns].regs = b ? k | bit : k;
+                o->states[ns].res = res[b];
+                ns++;
+            }
+    }
+    memcpy(o, c, sizeof(node));
+    o->s = ns;
+    o->r = c->r + 1 - ndrop;
+    if (valh) {
+        // as long as no states have merged the score just gains the new
+        // column and loses the dropped ones
+        if (ns == c->s) {
+            o->ham = c->ham + column_hamming(sl, nc);
+            for (int k = 0; k < 3; k++)
+                if ((D >> k) & 1)
+                    o->ham -= sl->contrib[ins[k]];
+        } else
+            o->ham = hamming_states(o);
+    }
+#ifdef TRACKMOVES
+    o->moves[o->nmoves] = *m;
+    o->moves[o->nmoves++].drop = D;
+#endif
+    return 1 << D;
+}
+
+static inline node *ind(node *arr, int i) {
+    return (node *)(((char *)arr)+i*data_size);
+}
+
 #ifndef BINARY
 
-static uint8_t apply8(const node *c, const move *m, node *o) {
+// lay[D] is the layout for dropping D from the inputs
+static uint8_t apply8(const node *c, const sliced *sl, layout *lay, const column *mt,
+                      const opinfo *oi, const move *m, node *o) {
     uint8_t ok = 0;
     assert(m->arity == 3 && m->drop == 0);
-    memcpy(o,c,data_size);
-    if (!apply(o,m)) {
-        // can only be register overflow
-        return 0;
-    }
+    const uint8_t ins[3] = {m->r1, m->r2, m->r3};
+    column nc;
+    new_column(sl, mt, oi, nc);
+    add_column(c, sl, m, nc, o);
     ok = 1;    
-    ok |= makefrom(o,1,0,m->r1);
-    ok |= makefrom(o,2,0,m->r2);
-    ok |= makefrom(o,4,0,m->r3);
-    if ((ok & 3) == 3)
-        ok |= makefrom(o,3,2,m->r1);
-    if ((ok & 5) == 5)
-        ok |= makefrom(o,5,4,m->r1);
+    if (drop_ok(sl, m->r1, nc))
+        ok |= dropfrom(c, sl, lay, 1, ins, 3, nc, m, ind(o,1));
+    if (drop_ok(sl, m->r2, nc))
+        ok |= dropfrom(c, sl, lay, 2, ins, 3, nc, m, ind(o,2));
+    if (drop_ok(sl, m->r3, nc))
+        ok |= dropfrom(c, sl, lay, 4, ins, 3, nc, m, ind(o,4));
+    // ok holds one bit per child; dropping more can only add collisions
     if ((ok & 6) == 6)
-        ok |= makefrom(o,6,4,m->r2);
+        ok |= dropfrom(c, sl, lay, 3, ins, 3, nc, m, ind(o,3));
+    if ((ok & 18) == 18)
+        ok |= dropfrom(c, sl, lay, 5, ins, 3, nc, m, ind(o,5));
+    if ((ok & 20) == 20)
+        ok |= dropfrom(c, sl, lay, 6, ins, 3, nc, m, ind(o,6));
     if ((ok & 104) == 104)
-        ok |= makefrom(o,7,6,m->r1);
+        ok |= dropfrom(c, sl, lay, 7, ins, 3, nc, m, ind(o,7));
     return ok;
 }
 
 #endif
 
-static uint8_t apply4(const node *c, const move *m, node *o) {
+static uint8_t apply4(const node *c, const sliced *sl, layout *lay, const column *mt,
+                      const opinfo *oi, const move *m, node *o) {
     uint8_t ok = 0;
     assert(m->arity == 2 && m->drop == 0);
-    memcpy(o,c,data_size);
-    if (!apply(o,m)) {
-        // can only be register overflow
-        return 0;
-    }
+    const uint8_t ins[2] = {m->r1, m->r2};
+    column nc;
+    new_column(sl, mt, oi, nc);
+    add_column(c, sl, m, nc, o);
     ok = 1;    
-    ok |= makefrom(o,1,0,m->r1);
-    ok |= makefrom(o,2,0,m->r2);
-    if ((ok & 3) == 3)
-        ok |= makefrom(o,3,2,m->r1);
+    if (drop_ok(sl, m->r1, nc))
+        ok |= dropfrom(c, sl, lay, 1, ins, 2, nc, m, ind(o,1));
+    if (drop_ok(sl, m->r2, nc))
+        ok |= dropfrom(c, sl, lay, 2, ins, 2, nc, m, ind(o,2));
+    if ((ok & 6) == 6)
+        ok |= dropfrom(c, sl, lay, 3, ins, 2, nc, m, ind(o,3));
     return ok;
 }    
 
@@ -295,7 +868,8 @@ static uint8_t apply4(const node *c, const move *m, node *o) {
 // Reps under permutation of inputs
 // Unary functions omitted 
 
-uint8_t TernaryOps [] = {
+#ifndef BINARY
+static const uint8_t TernaryOps [] = {
 #ifdef ARM
                          226, 216, 202, 172, 228, 184 //BIF, BIT, BSL
 #else
@@ -316,8 +890,9 @@ uint8_t TernaryOps [] = {
 #endif
 #endif
 };
+#endif
 
-uint8_t BinaryOps []  = {
+static const uint8_t BinaryOps []  = {
 #if ANDN || defined(ARM)                         
     2,4,
 #endif
@@ -327,10 +902,20 @@ uint8_t BinaryOps []  = {
 #endif
         };
 
-const int nterns =sizeof(TernaryOps);
-const int nbins =sizeof(BinaryOps);
+#define nterns ((int)sizeof(TernaryOps))
+#define nbins ((int)sizeof(BinaryOps))
+
+static void build_moves(void) {
+    int dropped = 0;
+#ifndef BINARY
+    nternmoves = add_moves(TernaryOps, nterns, 3, ternmoves, &dropped);
+#endif
+    nbinmoves = add_moves(BinaryOps, nbins, 2, binmoves, &dropped);
+    printf("Move table: %i ternary ops, %i binary ops, %i entries dropped\n",
+           nternmoves, nbinmoves, dropped);
+}
 
-void print_coding_inner(int nstates, int len, state *states) {
+static void print_coding_inner(int nstates, int len, state *states) {
     int i = 0;
     int lastres;
     int started = 0;
@@ -353,12 +938,13 @@ void print_coding_inner(int nstates, int len, state *states) {
     printf(")");
 }
 
-void print_coding(coding *c) {
+static void print_coding(coding *c) {
     print_coding_inner(c->size, c->len, c->codewords);    
 }
 
 
-void print_move(const move *m) {
+#if defined(TRACKMOVES) || defined(DEBUG)
+static void print_move(const move *m) {
     switch(m->arity) {
     case 1:
         printf("not(%i);",(int)m->r1);
@@ -392,7 +978,19 @@ void print_move(const move *m) {
         }
         printf(");");
     }
+#if defined(CANON) && defined(TRACKMOVES)
+    bool moved = false;
+    for (int i = 0; i < NREGS && m->relabel[i] != 0xFF; i++)
+        moved |= m->relabel[i] != i;
+    if (moved) {
+        printf(" relabel(");
+        for (int i = 0; i < NREGS && m->relabel[i] != 0xFF; i++)
+            printf(i ? ",%i" : "%i", (int)m->relabel[i]);
+        printf(");");
+    }
+#endif
 }
+#endif
 
 static void print_node(const char *np) {
     const node *n = (node *) np;
@@ -423,46 +1021,117 @@ static void print_node(const char *np) {
 
 
 
-static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
+// Children are indexed by the pair (i,j) of the first two registers of the
+// move, as i*r+j. The pair (i,i) carries the unary moves on i, pairs with
+// j > i the binary and ternary moves starting at i, j; the rest are empty.
+
+static uint64_t count_children(const char *parent) {
+    node *n = (node *)parent;
+    return (uint64_t)n->r * n->r;
+}
+
+static void visit_children_range(const char *parent, uint64_t lo, uint64_t hi,
+                                 void visit(const char *, void *), void *context) {
     node *n = (node *)parent;
 #ifdef DEBUG
     printf("VC ");
     print_node((const char *)n);
     printf("\n"); 
 #endif
-    node *ch = malloc(data_size);
-    node *children = malloc(data_size*8);
+    // the thread's scratch holds ch, children, sl and lay (lay[8] is sorting space)
+    size_t nodes = (data_size*9 + 63) & ~(size_t)63;
+    char *scratch = beam_scratch(context, nodes + sizeof(sliced) + sizeof(layout)*9);
+#if defined(BINARY) || defined(ARM)
+    node *ch = (node *)scratch;
+#endif
+    node *children = (node *)(scratch + data_size);
+    sliced *sl = (sliced *)(scratch + nodes);
+    layout *lay = (layout *)(scratch + nodes + sizeof(sliced));
+    column mt[8];
     move m;
-    for (int i = 0; i < n->r; i++) {
+    if (n->r >= NREGS) {
+        printf("Register overflow\n");
+        hi = lo;
+    }
+    slice(n, sl);
+    for (uint64_t x = lo; x < hi; x++) {
+        int i = x / n->r;
+        int j = x % n->r;
         m.r1 = i;
+        if (j == i) {
 #if defined(BINARY) || defined(ARM)        
-        m.arity = 1;
-        m.op = 1;
-        for (int drop = 0; drop < 2; drop++) {
-            m.drop = drop;
-            memcpy(ch, n, data_size);
-            if (apply(ch, &m)) {
+            m.arity = 1;
+            m.op = 1;
+            for (int drop = 0; drop < 2; drop++) {
+                m.drop = drop;
+                memcpy(ch, n, data_size);
+                if (apply(ch, &m)) {
+#ifdef CANON
+                    canonicalize(ch);
+#endif
 #ifdef DEBUG
-                printf("MOVE ");
-                print_move (&m);                            
-                printf(" CHILD ");
-                print_node((const char *)ch);
-                printf("\n");
+                    printf("MOVE ");
+                    print_move (&m);                            
+                    printf(" CHILD ");
+                    print_node((const char *)ch);
+                    printf("\n");
 #endif
-                (*visit)((char *)ch, context);
+                    (*visit)((char *)ch, context);
+                }
             }
+#endif
+            continue;
         }
+        if (j < i)
+            continue;
+        m.arity = 2;
+        m.drop = 0;
+        m.r2 = j;
+        uint8_t ins[3] = {i, j, 0};
+        minterms(sl, 2, ins, mt);
+        for (int D = 1; D < 4; D++)
+            lay[D].built = false;
+        for (int op = 0; op < nbinmoves; op++) {
+            m.op = binmoves[op].op;
+            uint8_t cases = apply4(n,sl,lay,mt,binmoves+op,&m,children);
+            for (int drop =0; drop < 4; drop ++) {
+                if (cases & (1 << drop)) {
+                    const char *child = ((const char *)children) + data_size*drop;
+#ifdef CANON
+                    canonicalize((node *)child);
 #endif
-        for (int j = i+1; j < n->r; j++) {
-            m.arity = 2;
-            m.drop = 0;
-            m.r2 = j;
-            for (int op = 0; op < nbins; op++) {
-                m.op = BinaryOps[op];                
-                uint8_t cases = apply4(n,&m,children);
-                for (int drop =0; drop < 4; drop ++) {
+#ifdef DEBUG
+                    m.drop = drop;
+                    printf("MOVE ");
+                    print_move (&m);                            
+                    printf(" CHILD ");
+                    print_node(child);
+                    printf("\n");
+                    m.drop = 0;
+#endif
+                    (*visit)(child, context);
+                }
+            }
+                
+        }
+#ifndef BINARY
+        m.arity = 3;
+        m.drop = 0;
+        for (int k = j+1; k < n->r; k++) {
+            m.r3 = k;
+            ins[2] = k;
+            minterms(sl, 3, ins, mt);
+            for (int D = 1; D < 8; D++)
+                lay[D].built = false;
+            for (int op = 0; op < nternmoves; op++) {
+                m.op = ternmoves[op].op;
+                uint8_t cases = apply8(n,sl,lay,mt,ternmoves+op,&m,children);
+                for (int drop =0; drop < 8; drop ++) {
                     if (cases & (1 << drop)) {
                         const char *child = ((const char *)children) + data_size*drop;
+#ifdef CANON
+                        canonicalize((node *)child);
+#endif
 #ifdef DEBUG
                         m.drop = drop;
                         printf("MOVE ");
@@ -475,38 +1144,14 @@ static void visit_children(const char *parent, void visit(const char *, void *),
                         (*visit)(child, context);
                     }
                 }
-                
             }
-#ifndef BINARY
-            m.arity = 3;
-            m.drop = 0;
-            for (int k = j+1; k < n->r; k++) {
-                m.r3 = k;
-                for (int op = 0; op < nterns; op++) {
-                    m.op = TernaryOps[op];
-                    uint8_t cases = apply8(n,&m,children);
-                    for (int drop =0; drop < 8; drop ++) {
-                        if (cases & (1 << drop)) {
-                            const char *child = ((const char *)children) + data_size*drop;
-#ifdef DEBUG
-                            m.drop = drop;
-                            printf("MOVE ");
-                            print_move (&m);                            
-                            printf(" CHILD ");
-                            print_node(child);
-                            printf("\n");
-                            m.drop = 0;
-#endif
-                            (*visit)(child, context);
-                        }
-                    }
-                }
-            }
-#endif
         }
+#endif
     }
-    free(children);
-    free(ch);
+}
+
+static void visit_children(const char *parent, void visit(const char *, void *), void *context) {
+    visit_children_range(parent, 0, count_children(parent), visit, context);
 }
 
 static bool equal(const char *a1, const char *a2) {
@@ -517,49 +1162,371 @@ static bool equal(const char *a1, const char *a2) {
         !memcmp((void *)n1->states, (void *)n2->states, sizeof(state)*n1->s);
 }
 
+// the same states in fewer registers: the spare registers can only cost,
+// so a is never worse than b
+static bool dominates(const char *a1, const char *a2) {
+    node *n1 = (node *)a1;
+    node *n2 = (node *)a2;
+    return n1->r <= n2->r &&
+        n1->s == n2->s &&
+        !memcmp((void *)n1->states, (void *)n2->states, sizeof(state)*n1->s);
+}
+
 #define fnvp 1099511628211ULL
 #define fnvob 14695981039346656037ULL
 
-// could shift to a faster hash
+// registers as the 16 bit build stores them, so that the 8 bit build hashes
+// nodes as it does and gives the same output (the 32 and 64 bit builds still
+// hash differently)
+#if REGBITS < 16
+#define HASHREGS(x) ((uint64_t)(x) << (16 - REGBITS))
+#else
+#define HASHREGS(x) ((uint64_t)(x))
+#endif
+
+// could shift to a faster hash. Leaves out r, so that nodes differing only
+// in their number of registers meet in the hash table; see dominates.
 static uint64_t hash( const char *c) {
     uint64_t h = fnvob;
     node *n = (node *)c;
-    h = (h*fnvp) ^ n->r;
     h = (h*fnvp) ^ n->s;    
     for (int i = 0; i < n->s; i++) {
-        h = (h*fnvp) ^ n->states[i].regs;
+        h = (h*fnvp) ^ HASHREGS(n->states[i].regs);
         h = (h*fnvp) ^ n->states[i].res;
     }
 
     return h;    
 }
 
-int fgetc1(FILE *f) {
+#ifdef CLOSED
+// for the closed set of nodes already expanded (CLOSED megabytes of it),
+// which should tell apart nodes that differ only in r
+static uint64_t closed_key(const char *c, uint64_t h) {
+    return h ^ (((node *)c)->r * 0x9E3779B97F4A7C15ULL);
+}
+#endif
+
+// good nodes as the search finds them, and the best of each generation,
+// so that a run cut short still shows what it found
+static void report(const char *c, int gen, bool best) {
+    #pragma omp critical(report)
+    {
+        printf("%s in generation %i: ", best ? "Best" : "Found", gen);
+        print_node(c);
+        printf("\n");
+    }
+}
+
+#ifdef HASHID
+// with hash, the identity of a node in place of equal, so duplicates are
+// found without reading the nodes in the table; unlike hash it includes r
+static uint64_t identity_hash(const char *c) {
+    node *n = (node *)c;
+    uint64_t h = (n->r * 0x9E3779B97F4A7C15ULL) ^ n->s;
+    for (int i = 0; i < n->s; i++) {
+        h = (h ^ (uint64_t)n->states[i].regs) * 0xFF51AFD7ED558CCDULL;
+        h = (h ^ (h >> 32) ^ n->states[i].res) * 0xC4CEB9FE1A85EC53ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+#endif
+
+// Bidirectional search. A spec on r registers gives, for each value of the
+// registers, the residue a state with that value must have, or none. A node
+// meets a spec when all its states agree with it. The target coding is a
+// spec, and undoing a move on a spec gives the spec its parent must meet,
+// so a backward beam of specs can meet the forward beam of nodes halfway.
+// Moves are undone exactly as visit_children makes them: inputs in
+// increasing order, the new register last, dropped inputs removed.
+
+#define SPECREGS 10
+#define NOWHERE (-1)
+
+typedef struct {
+    uint8_t r;
+    uint16_t allowed; // number of register values with a residue
+#ifdef TRACKMOVES
+    uint8_t nmoves;
+    move moves[MAXMOVE]; // moves[0] is the last move of the circuit
+#endif
+    int16_t res[1 << SPECREGS]; // indexed by the registers, register 0 highest
+} spec;
+
+static inline int spec_index(regs_t x, int r) {
+    return x >> (NREGS - r);
+}
+
+static spec *target_spec(const coding *t, int P) {
+    if (t->len > SPECREGS || P > INT16_MAX) {
+        printf("Target too big for bidirectional search\n");
+        exit(EXIT_FAILURE);
+    }
+    spec *s = calloc(sizeof(spec), 1);
+    s->r = t->len;
+    for (int x = 0; x < (1 << s->r); x++)
+        s->res[x] = NOWHERE;
+    for (int i = 0; i < t->size; i++) {
+        int x = spec_index(t->codewords[i].regs, s->r);
+        int res = t->codewords[i].res % P;
+        if (s->res[x] != NOWHERE && s->res[x] != res) {
+            printf("Contradiction found in target\n");
+            exit(EXIT_FAILURE);
+        }
+        if (s->res[x] == NOWHERE)
+            s->allowed++;
+        s->res[x] = res;
+    }
+    return s;
+}
+
+// the spec o that a parent with r registers must meet for the move on ins,
+// computing op and dropping D, to leave a child meeting s
+static bool undo(const spec *s, int r, const uint8_t *ins, int nin, uint8_t op, int D, spec *o) {
+    uint16_t keep = 0;
+    for (int i = 0; i < r; i++)
+        keep |= 1 << i;
+    for (int k = 0; k < nin; k++)
+        if ((D >> k) & 1)
+            keep &= ~(1 << ins[k]);
+    o->r = r;
+    o->allowed = 0;
+    for (int x = 0; x < (1 << r); x++) {
+        int t = 0, y = 0;
+        for (int k = 0; k < nin; k++)
+            t = (t << 1) | ((x >> (r-1-ins[k])) & 1);
+        for (int i = 0; i < r; i++)
+            if ((keep >> i) & 1)
+                y = (y << 1) | ((x >> (r-1-i)) & 1);
+        y = (y << 1) | ((op >> t) & 1);
+        o->res[x] = s->res[y];
+        o->allowed += o->res[x] != NOWHERE;
+    }
+    return o->allowed != 0;
+}
+
+// specs that allow more of their register values are easier to meet
+static fitness_t spec_fitness(const char *sp) {
+    const spec *s = (const spec *)sp;
+    return 1000000 + (((uint32_t)s->allowed << 10) >> s->r) - valreg*s->r;
+}
+
+static bool spec_equal(const char *a1, const char *a2) {
+    const spec *s1 = (const spec *)a1;
+    const spec *s2 = (const spec *)a2;
+    return s1->r == s2->r &&
+        !memcmp(s1->res, s2->res, sizeof(int16_t) << s1->r);
+}
+
+static uint64_t spec_hash(const char *sp) {
+    const spec *s = (const spec *)sp;
+    uint64_t h = fnvob;
+    h = (h*fnvp) ^ s->r;
+    for (int x = 0; x < (1 << s->r); x++)
+        h = (h*fnvp) ^ (uint16_t)s->res[x];
+    return h;
+}
+
+#ifdef TRACKMOVES
+// the moves after meeting s, in circuit order
+static void print_spec_moves(const spec *s) {
+    for (int i = s->nmoves-1; i >= 0; i--) {
+        printf(" ");
+        print_move(s->moves + i);
+    }
+}
+#endif
+
+static void print_spec(const char *sp) {
+    const spec *s = (const spec *)sp;
+    printf("spec on %i registers allowing %i values", s->r, s->allowed);
+#ifdef TRACKMOVES
+    if (s->nmoves) {
+        printf(", then");
+        print_spec_moves(s);
+    }
+#endif
+}
+
+static void undo_and_visit(const spec *s, int r, const uint8_t *ins, move *m, uint8_t op, int D,
+                           spec *o, void visit(const char *, void *), void *context) {
+    if (r > SPECREGS || !undo(s, r, ins, m->arity, op, D, o))
+        return;
+#ifdef TRACKMOVES
+    memcpy(o->moves, s->moves, sizeof(move)*s->nmoves);
+    o->nmoves = s->nmoves;
+    if (o->nmoves < MAXMOVE) {
+        m->drop = D;
+        o->moves[o->nmoves++] = *m;
+    }
+#endif
+    visit((const char *)o, context);
+}
+
+static void spec_visit_children(const char *parent, void visit(const char *, void *), void *context) {
+    const spec *s = (const spec *)parent;
+    spec *o = beam_scratch(context, sizeof(spec));
+    move m;
+    uint8_t ins[3];
+#if defined(BINARY) || defined(ARM)
+    m.arity = 1;
+    m.op = 1;
+    for (int D = 0; D < 2; D++) {
+        int r = s->r - 1 + D;
+        for (ins[0] = 0; ins[0] < r; ins[0]++) {
+            m.r1 = ins[0];
+            // not(x) is the op 1 on one input
+            undo_and_visit(s, r, ins, &m, 1, D, o, visit, context);
+        }
+    }
+#endif
+    m.arity = 2;
+    for (int D = 0; D < 4; D++) {
+        int r = s->r - 1 + __builtin_popcount(D);
+        for (ins[0] = 0; ins[0] < r; ins[0]++)
+            for (ins[1] = ins[0]+1; ins[1] < r; ins[1]++) {
+                m.r1 = ins[0];
+                m.r2 = ins[1];
+                for (int op = 0; op < nbinmoves; op++) {
+                    m.op = binmoves[op].op;
+                    undo_and_visit(s, r, ins, &m, m.op, D, o, visit, context);
+                }
+            }
+    }
+#ifndef BINARY
+    m.arity = 3;
+    for (int D = 0; D < 8; D++) {
+        int r = s->r - 1 + __builtin_popcount(D);
+        for (ins[0] = 0; ins[0] < r; ins[0]++)
+            for (ins[1] = ins[0]+1; ins[1] < r; ins[1]++)
+                for (ins[2] = ins[1]+1; ins[2] < r; ins[2]++) {
+                    m.r1 = ins[0];
+                    m.r2 = ins[1];
+                    m.r3 = ins[2];
+                    for (int op = 0; op < nternmoves; op++) {
+                        m.op = ternmoves[op].op;
+                        undo_and_visit(s, r, ins, &m, m.op, D, o, visit, context);
+                    }
+                }
+    }
+#endif
+}
+
+static bool meets(const node *n, const spec *s) {
+    if (n->r != s->r)
+        return false;
+    for (int i = 0; i < n->s; i++)
+        if (s->res[spec_index(n->states[i].regs, s->r)] != n->states[i].res)
+            return false;
+    return true;
+}
+
+// the key a node is filed under in the join: its register count and the
+// value and residue of its first state
+static inline uint64_t meet_key(int r, int x, int res) {
+    return (uint64_t)r << 32 | (uint64_t)x << 16 | (uint16_t)res;
+}
+
+// join the forward beam to the backward one, back steps from the target. The
+// nodes are hashed by their first state, and each spec looks up, for every
+// value it allows, the nodes whose first state has that value and the residue
+// the spec wants; only those are checked in full. A node is printed with the
+// first spec it meets. Returns the number of meetings.
+static int print_meetings(const char *nodes, size_t nnodes, const spec *specs, size_t nspecs,
+                          int back) {
+    int bits = 0, nmet = 0;
+    while ((size_t)1 << bits < nnodes)
+        bits++;
+    size_t nbuckets = (size_t)1 << bits;
+    uint64_t *keys = malloc(sizeof(uint64_t) * (nnodes ? nnodes : 1));
+    uint32_t *bybucket = malloc(sizeof(uint32_t) * (nnodes ? nnodes : 1));
+    size_t *start = calloc(nbuckets + 1, sizeof(size_t));
+    int *met = malloc(sizeof(int) * (nnodes ? nnodes : 1));
+    int first[SPECREGS+1]; // the first spec with each register count, for nodes without states
+    for (int r = 0; r <= SPECREGS; r++)
+        first[r] = -1;
+    for (int j = nspecs - 1; j >= 0; j--)
+        first[specs[j].r] = j;
+#define BUCKET(k) (bits ? ((k) * 0x9E3779B97F4A7C15ULL) >> (64 - bits) : 0)
+    for (size_t i = 0; i < nnodes; i++) {
+        const node *n = (const node *)(nodes + i*data_size);
+        met[i] = n->r <= SPECREGS && !n->s ? first[n->r] : -1;
+        keys[i] = n->r <= SPECREGS && n->s ? meet_key(n->r, spec_index(n->states[0].regs, n->r),
+                                                       n->states[0].res) : UINT64_MAX;
+        if (keys[i] != UINT64_MAX)
+            start[BUCKET(keys[i]) + 1]++;
+    }
+    for (size_t b = 0; b < nbuckets; b++)
+        start[b+1] += start[b];
+    size_t *at = malloc(sizeof(size_t) * nbuckets);
+    memcpy(at, start, sizeof(size_t) * nbuckets);
+    for (size_t i = 0; i < nnodes; i++)
+        if (keys[i] != UINT64_MAX)
+            bybucket[at[BUCKET(keys[i])]++] = i;
+    for (int j = 0; j < nspecs; j++) {
+        const spec *s = specs + j;
+        for (int x = 0; x < 1 << s->r; x++) {
+            if (s->res[x] == NOWHERE)
+                continue;
+            uint64_t k = meet_key(s->r, x, s->res[x]);
+            size_t b = BUCKET(k);
+            for (size_t e = start[b]; e < start[b+1]; e++) {
+                uint32_t i = bybucket[e];
+                if (keys[i] == k && met[i] < 0 && meets((const node *)(nodes + i*data_size), s))
+                    met[i] = j;
+            }
+        }
+    }
+#undef BUCKET
+    for (size_t i = 0; i < nnodes; i++) {
+        if (met[i] < 0)
+            continue;
+        print_node(nodes + i*data_size);
+#ifdef TRACKMOVES
+        printf(" then");
+        print_spec_moves(specs + met[i]);
+#else
+        printf(" then %i steps to the target", back);
+#endif
+        printf("\n");
+        nmet++;
+    }
+    free(keys);
+    free(bybucket);
+    free(start);
+    free(at);
+    free(met);
+    return nmet;
+}
+
+static int fgetc1(FILE *f) {
     int c;
     while (isspace(c = fgetc(f)))
         ;
     return c;
 }
 
-coding *read_coding(const char *fn) {
+static coding *read_coding(const char *fn) {
     FILE *f = fopen(fn, "r");
     if (!f)
         return NULL;
-    coding *c = calloc(sizeof(coding) + sizeof(state)*256,1);
-    uint8_t len = 0;
-    nstates_t size = 0;
+    coding *c = calloc(sizeof(coding) + sizeof(state)*MAXSTATES,1);
+    int len = 0;
+    int size = 0;
     res_t res;
     while (1) {
         int x;
         if (1 != fscanf(f,"%i", &x))
             break;
         res = x;
+        if (x != res)
+            c->toowide = true;
         int ch = fgetc1(f);
         if (ch != '(') {
             return NULL;
         }
         regs_t wd;
-        uint8_t thislen;
+        int thislen;
         while (1) {
             wd = 0;
             thislen = 0;
@@ -568,12 +1535,16 @@ coding *read_coding(const char *fn) {
                 if (ch == '0' || ch == '1') {
                     wd >>= 1;
                     if (ch == '1')
-                        wd |= 0x8000;
+                        wd |= (regs_t)1 << (NREGS-1);
                     thislen++;
                 } else if (ch == ',' || ch == ')') {
-                    c->codewords[size].regs = wd;
-                    c->codewords[size].res = res;
-                    size++;
+                    if (thislen > NREGS || size >= FAIL)
+                        c->toowide = true;
+                    else {
+                        c->codewords[size].regs = wd;
+                        c->codewords[size].res = res;
+                        size++;
+                    }
                     if (len == 0) {
                         len = thislen;                        
                     } else if (len != thislen) {
@@ -594,7 +1565,7 @@ coding *read_coding(const char *fn) {
     return c;
 }
 
-int read_params(const char *fn, int *P, int *steps, fitness_t *valreg, fitness_t *valstate, fitness_t *valh,
+static int read_params(const char *fn, int *P, int *steps, fitness_t *valreg, fitness_t *valstate, fitness_t *valh,
                 size_t *beamsize, fitness_t *maxval) {
     FILE *f = fopen(fn, "r");
     int a,b,c,d,e,g,v;
@@ -612,7 +1583,7 @@ int read_params(const char *fn, int *P, int *steps, fitness_t *valreg, fitness_t
 }
 
 static node *make_seed(coding *b, coding *c, int P) {
-    if (b->size*c->size > MAXSTATES) {
+    if (b->size*c->size >= FAIL) {
         printf("Too many states\n");
         exit(EXIT_FAILURE);
     }
@@ -634,51 +1605,192 @@ static node *make_seed(coding *b, coding *c, int P) {
         printf("Contradiction found in seed state\n");
         exit(EXIT_FAILURE);
     }
+    seed->ham = hamming_states(seed);
+#ifdef CANON
+    canonicalize(seed);
+#endif
     return seed;
 }
     
 
-int main(int argc, char **argv) {
+#ifndef TERNARY_MAIN
+#define TERNARY_MAIN ternary_main
+#define TERNARY_PRINTER ternary_printer
+#define STANDALONE
+#endif
+
+// the tag of this build's dumps, since their records' layout depends on it
+static void dump_tag(char *tag, size_t size) {
+    snprintf(tag, size, "ternary %i bit registers, %i bit state counts", REGBITS, STATEBITS);
+}
+
+beam_dump_print *TERNARY_PRINTER(const char *tag) {
+    char mine[72];
+    dump_tag(mine, sizeof(mine));
+    return strcmp(tag, mine) ? NULL : print_node;
+}
+
+// Returns TERNARY_TOO_WIDE, having printed nothing, if the problem does not
+// fit this build. With strict set that includes the registers added by
+// steps moves, otherwise only the seed has to fit.
+int TERNARY_MAIN(int argc, char **argv, bool strict) {
     size_t beamsize;
     int nprobes = 4;
     size_t nresults;
     int steps;
     fitness_t maxval;
     int P;
+    // -o: write the results to a binary dump, see dump.h, instead of listing them
+    // -c: capture the children of generation -g (default 0); -r: instead of
+    // searching, time inserting such a capture into the table, see beam_replay
+    // -d: deterministic insertion, see beam.h; -s: print good nodes as they
+    // are found, and the best of each generation
+    // -i: islands, and optionally every how many generations how many of the
+    // best nodes move on, see beam.h
+    // -m: megabytes for the tables, -t: seconds for the search; either lets
+    // the beam narrow from beamsize to fit, see memory_budget in beam.h
+    const char *dumpfile = NULL, *capture = NULL, *replay = NULL;
+    int capture_gen = 0, islands = 1, migrate_every = 0, migrants = 0;
+    size_t budget_mb = 0;
+    double deadline = 0;
+    bool deterministic = false, stream = false;
+    while (argc > 2 && argv[1][0] == '-') {
+        // the flags without an argument
+        if (!strcmp(argv[1], "-d") || !strcmp(argv[1], "-s")) {
+            if (argv[1][1] == 'd')
+                deterministic = true;
+            else
+                stream = true;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (!strcmp(argv[1], "-o"))
+            dumpfile = argv[2];
+        else if (!strcmp(argv[1], "-c"))
+            capture = argv[2];
+        else if (!strcmp(argv[1], "-r"))
+            replay = argv[2];
+        else if (!strcmp(argv[1], "-g"))
+            capture_gen = atoi(argv[2]);
+        else if (!strcmp(argv[1], "-i"))
+            sscanf(argv[2], "%i:%i:%i", &islands, &migrate_every, &migrants);
+        else if (!strcmp(argv[1], "-m"))
+            budget_mb = strtoul(argv[2], NULL, 10);
+        else if (!strcmp(argv[1], "-t"))
+            deadline = atof(argv[2]);
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
     if (argc < 4) {
-        printf("Usage: ternary <b-code> <c-code> <params>\n");
+        printf("Usage: ternary [-d] [-s] [-o <dump>] [-c <capture> [-g <generation>]] [-r <capture>]\n"
+               "               [-i <islands>[:<every>:<migrants>]] [-m <megabytes>] [-t <seconds>]\n"
+               "               <b-code> <c-code> <params> [<target-code>]\n");
         exit(EXIT_FAILURE);
     }
     coding *b = read_coding(argv[1]);
-    if(b) {
-        printf("B coding:");
-        print_coding(b);
-        printf("\n");
-    }
     coding *c = read_coding(argv[2]);
-    if (c) {
-        printf("C coding:");
-        print_coding(c);
-        printf("\n");
-    }
-    if (!b || !c || !read_params(argv[3], &P, &steps, &valreg, &valstate, &valh, &beamsize, &maxval)) {
+    // with a target, search both ways and join in the middle
+    coding *t = argc > 4 ? read_coding(argv[4]) : NULL;
+    if (!b || !c || (argc > 4 && !t) ||
+        !read_params(argv[3], &P, &steps, &valreg, &valstate, &valh, &beamsize, &maxval)) {
         printf("Error reading files\n");
         exit(EXIT_FAILURE);
     }
+    if (b->toowide || c->toowide || (t && t->toowide) || b->len+c->len + (strict ? steps : 0) > NREGS ||
+        b->size*c->size >= FAIL || P-1 > (res_t)~0) {
+        free(b);
+        free(c);
+        free(t);
+        return TERNARY_TOO_WIDE;
+    }
+    // rounded up so that nodes side by side stay aligned
+    data_size = (sizeof(node) + sizeof(state)*b->size*c->size + _Alignof(node)-1) & ~(_Alignof(node)-1);
+    beam_options opts;
+    beam_default_options(&opts);
+    opts.count_children = count_children;
+    opts.visit_children_range = visit_children_range;
+    opts.dominates = dominates;
+#ifdef CLOSED
+    opts.closed_bytes = (size_t)CLOSED << 20;
+    opts.closed_key = closed_key;
+#endif
+#ifdef HASHID
+    opts.identity_hash = identity_hash;
+#ifdef DEBUG
+    opts.verify_identity = true;
+#endif
+#endif
+    if (stream)
+        opts.sink = report;
+    opts.sink_threshold = 1000000 - maxval;
+    opts.capture = capture;
+    opts.capture_gen = capture_gen;
+    opts.deterministic = deterministic;
+    opts.islands = islands;
+    opts.migrate_every = migrate_every;
+    opts.migrants = migrants;
+    opts.memory_budget = budget_mb << 20;
+    opts.deadline = deadline;
+    // a replay only inserts, so it needs none of the setup below
+    if (replay)
+        exit(beam_replay(&opts, replay, data_size, fitness, equal, hash) ? EXIT_FAILURE : EXIT_SUCCESS);
+    printf("B coding:");
+    print_coding(b);
+    printf("\n");
+    printf("C coding:");
+    print_coding(c);
+    printf("\n");
+    if (t) {
+        printf("Target coding:");
+        print_coding(t);
+        printf("\n");
+#ifdef CANON
+        printf("Bidirectional search needs a build without CANON\n");
+        exit(EXIT_FAILURE);
+#endif
+    }
 #ifdef TRACKMOVES
     if (steps > MAXMOVE) {
         printf("No room to record that many steps -- recompile with bigger MAXMOVE\n");
         exit(EXIT_FAILURE);
     }
 #endif
-    data_size = sizeof(node) + sizeof(state)*b->size*c->size;
     printf("Parameters: %i %u %u %i %i %lu %u\n", P, steps, valreg, valstate, valh, beamsize,maxval);
+    printf("Widths: %i bit registers, %i bit state counts\n", REGBITS, STATEBITS);
+    build_masks();
+    build_moves();
     node *seed = make_seed(b,c,P);
     printf("Starting search at ");
     print_node((char *)seed);
     printf("\n");
-    char * results = beam_search((char *)seed,1,visit_children, beamsize, steps,
-                                 data_size,  fitness, equal, hash, nprobes, print_node, &nresults);
+    int back = t ? steps/2 : 0;
+    char * results = beam_search_opts(&opts, (char *)seed,1,visit_children, beamsize, steps - back,
+                                      data_size,  fitness, equal, hash, nprobes, print_node, &nresults);
+    if (dumpfile) {
+        char tag[72];
+        dump_tag(tag, sizeof(tag));
+        if (beam_dump_write(dumpfile, tag, results, nresults, data_size, fitness, hash)) {
+            perror(dumpfile);
+            exit(EXIT_FAILURE);
+        }
+        printf("Wrote %lu nodes to %s\n", nresults, dumpfile);
+        if (!t) // with a target, the forward nodes dumped are then joined to the specs
+            exit(EXIT_SUCCESS);
+    }
+    if (t) {
+        spec *target = target_spec(t, P);
+        printf("Searching back %i steps from the target\n", back);
+        size_t nspecs;
+        spec *specs = (spec *)beam_search((char *)target, 1, spec_visit_children, beamsize, back,
+                                          sizeof(spec), spec_fitness, spec_equal, spec_hash,
+                                          nprobes, print_spec, &nspecs);
+        int nmet = print_meetings(results, nresults, specs, nspecs, back);
+        printf("%i of %lu forward nodes meet one of %lu specs\n", nmet, nresults, nspecs);
+        exit(EXIT_SUCCESS);
+    }
     for (int i = 0; i < nresults; i++) {
         const char *n = results + i*data_size;
         int f = fitness(n);
@@ -689,3 +1801,12 @@ int main(int argc, char **argv) {
     }
     exit(EXIT_SUCCESS);
 }
+
+#ifdef STANDALONE
+int main(int argc, char **argv) {
+    if (ternary_main(argc, argv, false) == TERNARY_TOO_WIDE) {
+        printf("Problem too big -- recompile with bigger REGBITS or STATEBITS\n");
+        exit(EXIT_FAILURE);
+    }
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef TERNARY_H
+#define TERNARY_H
+
+#include "dump.h"
+#include <stdbool.h>
+
+// ternary.c is built once for each width of state. Each build has its own
+// entry point, and ternary_main.c runs the narrowest that fits.
+
+#define TERNARY_TOO_WIDE 2
+
+int ternary_main_8_8(int argc, char **argv, bool strict);
+int ternary_main_16_8(int argc, char **argv, bool strict);
+int ternary_main_16_16(int argc, char **argv, bool strict);
+int ternary_main_32_8(int argc, char **argv, bool strict);
+int ternary_main_32_16(int argc, char **argv, bool strict);
+int ternary_main_64_8(int argc, char **argv, bool strict);
+int ternary_main_64_16(int argc, char **argv, bool strict);
+
+// for beamdump: print_node, if the dump with this tag came from the build
+beam_dump_print *ternary_printer_8_8(const char *tag);
+beam_dump_print *ternary_printer_16_8(const char *tag);
+beam_dump_print *ternary_printer_16_16(const char *tag);
+beam_dump_print *ternary_printer_32_8(const char *tag);
+beam_dump_print *ternary_printer_32_16(const char *tag);
+beam_dump_print *ternary_printer_64_8(const char *tag);
+beam_dump_print *ternary_printer_64_16(const char *tag);
+
+#endif
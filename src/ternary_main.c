@@ -0,0 +1,24 @@
+#include "ternary.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// narrowest first: a state is two registers wide, and the state count only
+// matters to the bit-sliced view
+static int (*const builds[])(int, char **, bool) = {
+    ternary_main_8_8, ternary_main_16_8, ternary_main_16_16, ternary_main_32_8,
+    ternary_main_32_16, ternary_main_64_8, ternary_main_64_16
+};
+#define NBUILDS (sizeof(builds)/sizeof(builds[0]))
+
+int main(int argc, char **argv) {
+    // first a build that every node of the search fits, failing that one
+    // the seed fits, which drops children that run out of registers
+    for (int strict = 1; strict >= 0; strict--)
+        for (int i = 0; i < NBUILDS; i++) {
+            int r = builds[i](argc, argv, strict);
+            if (r != TERNARY_TOO_WIDE)
+                return r;
+        }
+    printf("Problem too big for any build\n");
+    exit(EXIT_FAILURE);
+}